@@ -0,0 +1,110 @@
+// Measures snapshot size and save/load throughput for each format and codec, how much of a save
+// `ASTSaver::save_async` keeps the caller waiting for, and how much faster `LoadMode::kLazy` gets
+// to the declarations.
+//
+// Usage: compression_bench [number of functions] [output directory]
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <future>
+#include <string>
+#include <vector>
+
+#include "ast/context.h"
+#include "ast/decl.h"
+#include "ast/expr.h"
+#include "ast/stmt.h"
+#include "ast/type.h"
+#include "serde/codec.h"
+#include "serde/container.h"
+#include "serde/deserialize.h"
+#include "serde/serialize.h"
+#include "utility/logging.h"
+
+namespace {
+/// Functions of a few local variables each, initialized from the parameters.
+void build(ast::ASTContext &ctx, std::size_t num_funcs) {
+  auto *i32 = ctx.create<ast::IntegralType>(true, 32);
+  auto *cu = ctx.create<ast::CompilationUnitDecl>("_unit_");
+  for (std::size_t f = 0; f < num_funcs; f++) {
+    std::vector<ast::Stmt *> stmts;
+    for (std::uint64_t v = 0; v < 8; v++) {
+      auto *init = ctx.create<ast::BinaryExpr>(ast::BinaryExpr::kAdd,
+                                               ctx.create<ast::DeclRefExpr>("param"),
+                                               ctx.create<ast::IntegerLiteralExpr>(v * f));
+      auto *var = ctx.create<ast::VarDecl>("local_" + std::to_string(v), i32, init);
+      stmts.push_back(ctx.create<ast::DeclStmt>(var));
+    }
+    stmts.push_back(ctx.create<ast::ReturnStmt>(ctx.create<ast::DeclRefExpr>("local_7")));
+    auto *body = ctx.create<ast::BlockExpr>(stmts);
+    auto params = std::vector<ast::FuncDecl::ParamSpec>{{"param", i32}};
+    cu->decls.push_back(
+        ctx.create<ast::FuncDecl>("function_" + std::to_string(f), params, i32, body));
+  }
+}
+
+template <typename F>
+double seconds(F &&func) {
+  const auto begin = std::chrono::steady_clock::now();
+  func();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  const std::size_t num_funcs = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 100000;
+  const std::filesystem::path dir = argc > 2 ? argv[2] : std::filesystem::temp_directory_path();
+  utility::logging::level = utility::logging::Level::kWarning;
+
+  ast::ASTContext ctx;
+  build(ctx, num_funcs);
+
+  struct Config {
+    const char *name;
+    serde::io::Format format;
+    serde::CodecId codec;
+  };
+  const Config configs[] = {
+      {"fixed", serde::io::Format::kFixed, serde::CodecId::kNone},
+      {"fixed+lz", serde::io::Format::kFixed, serde::CodecId::kLz},
+      {"compact", serde::io::Format::kCompact, serde::CodecId::kNone},
+      {"compact+lz", serde::io::Format::kCompact, serde::CodecId::kLz},
+  };
+
+  std::printf("%zu functions\n", num_funcs);
+  std::printf("%-12s %12s %12s %7s %12s %12s %12s %12s\n", "config", "raw bytes", "file bytes",
+              "ratio", "save MB/s", "async MB/s", "load MB/s", "lazy MB/s");
+  for (const auto &config : configs) {
+    const auto path = dir / (std::string{"compression_bench."} + config.name + ".snapshot");
+    const double save_time =
+        seconds([&] { serde::ASTSaver{ctx, path, config.format, config.codec}.save(); });
+    std::shared_future<void> written;
+    const double async_time = seconds([&] {
+      written = serde::ASTSaver{ctx, path, config.format, config.codec}.save_async();
+    });
+    written.get();
+
+    std::uint64_t raw_bytes = 0;
+    const serde::SnapshotReader reader{path, serde::LoadMode::kStream};
+    for (const auto &s : reader.sections())
+      raw_bytes += s.raw_length;
+    const auto file_bytes = std::filesystem::file_size(path);
+
+    ast::ASTContext loaded;
+    const double load_time = seconds([&] { serde::ASTLoader{loaded, path}.load(); });
+    ast::ASTContext lazy;
+    const double lazy_time =
+        seconds([&] { serde::ASTLoader{lazy, path, serde::LoadMode::kLazy}.load(); });
+    std::filesystem::remove(path);
+
+    std::printf("%-12s %12llu %12llu %7.2f %12.1f %12.1f %12.1f %12.1f\n", config.name,
+                static_cast<unsigned long long>(raw_bytes),
+                static_cast<unsigned long long>(file_bytes),
+                static_cast<double>(raw_bytes) / file_bytes, raw_bytes / save_time / 1e6,
+                raw_bytes / async_time / 1e6, raw_bytes / load_time / 1e6,
+                raw_bytes / lazy_time / 1e6);
+  }
+}
@@ -141,7 +141,7 @@ void PrettyPrintVisitor::visit(FuncDecl& node) {
   traverse_node(node.return_type);
 
   _out_stream << ' ';
-  traverse_node(node.body);
+  traverse_node(node.get_body());
 }
 
 void PrettyPrintVisitor::visit(ClassDecl& node) {
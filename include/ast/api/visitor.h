@@ -6,6 +6,7 @@
 
 #include "ast/decl.h"
 #include "ast/expr.h"
+#include "ast/node_ref.h"
 #include "ast/stmt.h"
 #include "ast/type.h"
 
@@ -72,6 +73,11 @@ class Visitor {
       return;
     x->accept(*this);
   }
+
+  template <typename T>
+  void traverse_node(NodeRef<T> x) {
+    traverse_node(x.get());
+  }
 };
 }  // namespace ast
 
@@ -111,7 +117,7 @@ R Visitor<R>::visit(VarDecl& node) {
 
 template <typename R>
 R Visitor<R>::visit(FuncDecl& node) {
-  traverse_node(node.body);
+  traverse_node(node.get_body());
 }
 
 template <typename R>
@@ -9,6 +9,9 @@ struct Decl;
 struct Expr;
 struct Stmt;
 
+template <typename T>
+class NodeRef;
+
 #define TYPE(x) struct x##Type;
 #define DECL(x) struct x##Decl;
 #define EXPR(x) struct x##Expr;
@@ -0,0 +1,294 @@
+#ifndef AST_COMPACT__H
+#define AST_COMPACT__H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "ast/ast_fwd.h"
+#include "ast/context.h"
+#include "ast/decl.h"
+#include "ast/dispatch.h"
+#include "ast/node_ref.h"
+#include "pool.h"
+#include "reflect/walk.h"
+
+namespace ast::detail {
+template <typename Seq>
+struct CompactionsOf;
+template <std::size_t... Is>
+struct CompactionsOf<std::index_sequence<Is...>> {
+  using type = std::tuple<typename Pool<std::tuple_element_t<Is, Nodes>>::Compaction...>;
+};
+
+class Compactor {
+ public:
+  explicit Compactor(ASTContext &ctx) : _ctx{ctx} {}
+
+  void run() {
+    begin();
+    for_each_class([this](auto tag) {
+      using T = typename decltype(tag)::type;
+      _ctx.pool<T>().for_each([this](std::size_t, T &node) { redirect(node); });
+    });
+    finish();
+  }
+
+  /// Lays out the new pools; nothing has moved yet.
+  void begin() {
+    index_chunks();
+    drop_stale_users();
+    order_nodes();
+    begin_compactions(std::make_index_sequence<kNumNodeClasses>{});
+  }
+
+  /// Points the pointers and `NodeRef`s in `object`, a node or any reflected object, at where
+  /// their nodes will be. Between `begin` and `finish` only.
+  template <typename T>
+  void redirect(T &object) {
+    reflect::for_each_node_pointer(object, [this](auto &field, bool) { redirect_field(field); });
+    if constexpr (std::is_base_of_v<Decl, T>) {
+      std::unordered_set<void *> users;
+      users.reserve(object.users.size());
+      for (void *user : object.users)
+        users.insert(new_address(user));
+      object.users.swap(users);
+    }
+  }
+
+  /// Moves the nodes and frees the old pools.
+  void finish() {
+    finish_compactions(std::make_index_sequence<kNumNodeClasses>{});
+  }
+
+ private:
+  using Compactions = typename CompactionsOf<std::make_index_sequence<kNumNodeClasses>>::type;
+
+  struct ChunkRange {
+    std::uintptr_t begin;
+    std::uintptr_t end;
+    std::size_t ordinal;
+    std::size_t first_index;
+    std::size_t stride;
+  };
+
+  template <typename F>
+  static void for_each_class(F &&func) {
+    for (std::size_t i = 0; i < kNumNodeClasses; i++)
+      with_node_class(i, func);
+  }
+
+  /// Pre-order DFS from every `CompilationUnitDecl` over owning (non-`REF_FIELD`) pointers; nodes
+  /// that cannot be reached keep their relative order after the reachable ones.
+  void order_nodes() {
+    for_each_class([this](auto tag) {
+      using T = typename decltype(tag)::type;
+      constexpr auto ord = kNodeOrdinal<T>;
+      _visited[ord].assign(_ctx.pool<T>().num_slots(), false);
+      _orders[ord].reserve(_ctx.pool<T>().num_nodes());
+    });
+    _ctx.pool<CompilationUnitDecl>().for_each(
+        [this](std::size_t, CompilationUnitDecl &cu) { dfs(&cu); });
+    for_each_class([this](auto tag) {
+      using T = typename decltype(tag)::type;
+      _ctx.pool<T>().for_each([this](std::size_t, T &node) { dfs(&node); });
+    });
+  }
+
+  template <typename T>
+  bool mark(T *node) {
+    auto &visited = _visited[kNodeOrdinal<T>];
+    const std::size_t i = Pool<T>::index_of(node);
+    if (visited[i])
+      return false;
+    visited[i] = true;
+    return true;
+  }
+
+  template <typename T>
+  void dfs(T *root) {
+    if (!mark(root))
+      return;
+    std::vector<std::pair<std::size_t, void *>> stack{{kNodeOrdinal<T>, root}};
+    std::vector<std::pair<std::size_t, void *>> children;
+    while (!stack.empty()) {
+      auto [ord, ptr] = stack.back();
+      stack.pop_back();
+      with_node_class(ord, [&](auto tag) {
+        using C = typename decltype(tag)::type;
+        auto *node = static_cast<C *>(ptr);
+        _orders[ord].push_back(static_cast<std::uint32_t>(Pool<C>::index_of(node)));
+        children.clear();
+        reflect::for_each_node_pointer(*node, [&](auto &field, bool is_ref) {
+          auto *child = target_of(field);
+          if (is_ref || !child)
+            return;
+          visit_concrete(child, [&](auto *concrete) {
+            if (mark(concrete))
+              children.emplace_back(kNodeOrdinal<std::remove_pointer_t<decltype(concrete)>>,
+                                    concrete);
+          });
+        });
+        stack.insert(stack.end(), children.rbegin(), children.rend());
+      });
+    }
+  }
+
+  template <std::size_t... Is>
+  void begin_compactions(std::index_sequence<Is...>) {
+    ((std::get<Is>(_compactions) =
+          _ctx.pool<std::tuple_element_t<Is, Nodes>>().begin_compaction(std::move(_orders[Is]))),
+     ...);
+  }
+
+  template <std::size_t... Is>
+  void finish_compactions(std::index_sequence<Is...>) {
+    (_ctx.pool<std::tuple_element_t<Is, Nodes>>().finish_compaction(
+         std::move(std::get<Is>(_compactions))),
+     ...);
+  }
+
+  /// Sorted address ranges of every chunk, to find the class of a node known only as `void *`.
+  void index_chunks() {
+    for_each_class([this](auto tag) {
+      using T = typename decltype(tag)::type;
+      _ctx.pool<T>().for_each_chunk(
+          [this](const void *first, std::size_t first_index, std::size_t n) {
+            const auto begin = reinterpret_cast<std::uintptr_t>(first);
+            _chunks.push_back({begin, begin + n * Pool<T>::kSlotSize, kNodeOrdinal<T>,
+                               first_index, Pool<T>::kSlotSize});
+          });
+    });
+    std::sort(_chunks.begin(), _chunks.end(),
+              [](const auto &lhs, const auto &rhs) { return lhs.begin < rhs.begin; });
+  }
+
+  template <typename T>
+  T *new_address(T *node) {
+    using C = std::remove_const_t<T>;
+    return std::get<kNodeOrdinal<C>>(_compactions).new_address(Pool<C>::index_of(node));
+  }
+
+  /// The class ordinal and slot index of a node known only as `void *`; nullopt if it is not in
+  /// the pools of the context, e.g. a user in another context.
+  std::optional<std::pair<std::size_t, std::size_t>> find_slot(const void *node) const {
+    const auto addr = reinterpret_cast<std::uintptr_t>(node);
+    auto it = std::upper_bound(_chunks.begin(), _chunks.end(), addr,
+                               [](std::uintptr_t a, const auto &range) { return a < range.begin; });
+    if (it == _chunks.begin() || addr >= (--it)->end)
+      return std::nullopt;
+    return {{it->ordinal, it->first_index + (addr - it->begin) / it->stride}};
+  }
+
+  /// Nodes outside the pools do not move.
+  void *new_address(void *node) {
+    const auto slot = find_slot(node);
+    if (!slot)
+      return node;
+    void *result = nullptr;
+    with_node_class(slot->first, [&, old_index = slot->second](auto tag) {
+      using C = typename decltype(tag)::type;
+      result = std::get<kNodeOrdinal<C>>(_compactions).new_address(old_index);
+    });
+    return result;
+  }
+
+  /// `destroy` leaves `Decl::users` as is, so a user may since have been destroyed, its slot
+  /// maybe reused by a node that does not refer to the declaration. Such users are dropped before
+  /// any pointer is redirected. Users outside the pools of the context are none of its business
+  /// and stay as they are.
+  void drop_stale_users() {
+    for_each_class([this](auto tag) {
+      using T = typename decltype(tag)::type;
+      if constexpr (std::is_base_of_v<Decl, T>) {
+        _ctx.pool<T>().for_each([this](std::size_t, T &decl) {
+          for (auto it = decl.users.begin(); it != decl.users.end();)
+            it = refers_to(*it, &decl) ? std::next(it) : decl.users.erase(it);
+        });
+      }
+    });
+  }
+
+  /// Whether `user` is a live node with a pointer to `decl`, or a node outside the pools.
+  bool refers_to(const void *user, const void *decl) {
+    const auto slot = find_slot(user);
+    if (!slot)
+      return true;
+    bool result = false;
+    with_node_class(slot->first, [&, index = slot->second](auto tag) {
+      using C = typename decltype(tag)::type;
+      auto &pool = _ctx.pool<C>();
+      if (!pool.is_live(index))
+        return;
+      reflect::for_each_node_pointer(pool.at(index), [&](auto &field, bool) {
+        if (auto *ptr = target_of(field))
+          visit_concrete(ptr, [&](auto *concrete) {
+            result |= static_cast<const void *>(concrete) == decl;
+          });
+      });
+    });
+    return result;
+  }
+
+  template <typename U>
+  void redirect_field(U *&ptr) {
+    if (!ptr)
+      return;
+    visit_concrete(ptr, [&](auto *concrete) { ptr = static_cast<U *>(new_address(concrete)); });
+  }
+
+  /// A `NodeRef` keeps its class and takes the new slot index.
+  template <typename U>
+  void redirect_field(NodeRef<U> &ref) {
+    if (!ref)
+      return;
+    with_node_class(ref.ordinal(), [&](auto tag) {
+      using C = typename decltype(tag)::type;
+      const auto index = std::get<kNodeOrdinal<C>>(_compactions).new_index(ref.index());
+      ref = NodeRef<U>::from_raw((ref.raw() & ~NodeRef<U>::kIndexMask) |
+                                 static_cast<std::uint32_t>(index));
+    });
+  }
+
+  /// The node that a pointer or `NodeRef` field refers to.
+  template <typename U>
+  static U *target_of(U *ptr) {
+    return ptr;
+  }
+  template <typename U>
+  U *target_of(NodeRef<U> ref) {
+    return ref.get(_ctx);
+  }
+
+ private:
+  ASTContext &_ctx;
+  std::array<std::vector<std::uint32_t>, kNumNodeClasses> _orders;
+  std::array<std::vector<bool>, kNumNodeClasses> _visited;
+  Compactions _compactions;
+  std::vector<ChunkRange> _chunks;
+};
+}  // namespace ast::detail
+
+namespace ast {
+/// Moves the live nodes of every pool into a dense, traversal-friendly order and fixes every
+/// pointer and `NodeRef` to them, `REF_FIELD`s and `Decl::users` included. Users destroyed since
+/// they were added are dropped from `Decl::users`.
+///
+/// Nodes are laid out in DFS pre-order from each `CompilationUnitDecl`, so walking a function
+/// touches its nodes roughly in address order again. Slot indices, handles and any pointer held
+/// outside the pools are invalidated, so nodes still in a lazily loaded snapshot are loaded first.
+inline void compact_pools(ASTContext &ctx = ASTContext::global()) {
+  ctx.load_lazy_nodes();
+  detail::Compactor{ctx}.run();
+}
+}  // namespace ast
+
+#endif  // AST_COMPACT__H
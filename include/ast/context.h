@@ -0,0 +1,157 @@
+#ifndef AST_CONTEXT__H
+#define AST_CONTEXT__H
+
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <optional>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "ast/ast_fwd.h"
+#include "ast/decl.h"
+#include "ast/expr.h"
+#include "ast/stmt.h"
+#include "ast/type.h"
+#include "pool.h"
+
+namespace ast::detail {
+template <typename Seq>
+struct PoolsOf;
+template <std::size_t... Is>
+struct PoolsOf<std::index_sequence<Is...>> {
+  using type = std::tuple<Pool<std::tuple_element_t<Is, Nodes>>...>;
+};
+}  // namespace ast::detail
+
+namespace ast {
+/// Owns one `Pool` per node class, that is, one AST.
+///
+/// Contexts are independent of each other: each can be built, saved, loaded and dropped on its
+/// own, in parallel with the others. Dropping a context frees its pools in bulk. `global()` is the
+/// context behind `Pool<T>::instance()`.
+class ASTContext final {
+ public:
+  /// A snapshot file by its `serde::SnapshotInfo`: the ID of the full snapshot, and how many
+  /// deltas are on top of it.
+  struct SnapshotState {
+    std::uint64_t base_id;
+    std::uint32_t num_deltas;
+  };
+
+ public:
+  ASTContext() = default;
+  ASTContext(const ASTContext &) = delete;
+  ASTContext(ASTContext &&) = delete;
+  ASTContext &operator=(const ASTContext &) = delete;
+  ASTContext &operator=(ASTContext &&) = delete;
+
+  static ASTContext &global() {
+    static ASTContext singleton;
+    return singleton;
+  }
+
+ public:
+  template <typename T>
+  Pool<T> &pool() {
+    return std::get<Pool<T>>(_pools);
+  }
+
+  template <typename T, typename... Args>
+  T *create(Args &&...args) {
+    return pool<T>().create(std::forward<Args>(args)...);
+  }
+
+  template <typename T>
+  void destroy(T *node) {
+    pool<T>().destroy(node);
+  }
+
+  /// Records that `node` was modified in place, for `serde::ASTSaver::save_delta`.
+  template <typename T>
+  void mark_dirty(const T *node) {
+    pool<T>().mark_dirty(node);
+  }
+
+  void clear_dirty() {
+    std::apply([](auto &...pools) { (pools.clear_dirty(), ...); }, _pools);
+  }
+
+  /// The snapshot the context was last saved to or loaded from, which the dirty slots are the
+  /// changes since; `serde::ASTSaver::save_delta` only adds deltas to that one.
+  const std::optional<SnapshotState> &snapshot_state() const {
+    return _snapshot_state;
+  }
+
+  void set_snapshot_state(std::optional<SnapshotState> state) {
+    _snapshot_state = state;
+  }
+
+  /// Records the save that `serde::ASTSaver::save_async` is still writing in the background.
+  void set_pending_save(std::shared_future<void> written) {
+    _pending_save = std::move(written);
+  }
+
+  /// Waits for the pending save, if any. The saver cleared the dirty slots already, so if that save
+  /// failed, every slot counts as changed again and the context matches no snapshot. The error
+  /// itself goes to whoever holds the future.
+  void wait_for_save() {
+    if (!_pending_save.valid())
+      return;
+    try {
+      std::exchange(_pending_save, {}).get();
+    } catch (...) {
+      std::apply([](auto &...pools) { (pools.mark_all_dirty(), ...); }, _pools);
+      _snapshot_state.reset();
+    }
+  }
+
+  /// Keeps `resource` alive as long as the nodes, e.g. a file mapping their string views point
+  /// into.
+  void retain(std::shared_ptr<const void> resource) {
+    _retained.push_back(std::move(resource));
+  }
+
+  /// Records what decodes the nodes a lazily loaded snapshot left out, see
+  /// `serde::LoadMode::kLazy`, and keeps it alive as long as the nodes.
+  void set_lazy_source(std::shared_ptr<LazySource> source) {
+    _lazy_source = std::move(source);
+  }
+
+  /// Decodes every node still in a lazily loaded snapshot, and points the function bodies still
+  /// there at theirs. Anything that walks the pools as a whole, such as saving or compacting,
+  /// must call it first, or nodes not loaded yet would be lost.
+  void load_lazy_nodes() {
+    if (!_lazy_source)
+      return;
+    _lazy_source->load_all();
+    pool<FuncDecl>().for_each([](std::size_t, FuncDecl &fn) { fn.get_body(); });
+  }
+
+  /// Waits for the pending save first, so that its outcome cannot affect what the context holds
+  /// next.
+  void clear() {
+    wait_for_save();
+    std::apply([](auto &...pools) { (pools.clear(), ...); }, _pools);
+    _retained.clear();
+    _lazy_source.reset();
+    _snapshot_state.reset();
+  }
+
+ private:
+  typename detail::PoolsOf<std::make_index_sequence<std::tuple_size_v<Nodes> - 1>>::type _pools;
+  std::vector<std::shared_ptr<const void>> _retained;
+  std::shared_ptr<LazySource> _lazy_source;
+  std::optional<SnapshotState> _snapshot_state;
+  std::shared_future<void> _pending_save;
+};
+
+template <typename T>
+Pool<T> &Pool<T>::instance() {
+  return ASTContext::global().pool<T>();
+}
+}  // namespace ast
+
+#endif  // AST_CONTEXT__H
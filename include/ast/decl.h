@@ -1,9 +1,11 @@
 #ifndef AST_DECL__H
 #define AST_DECL__H
 
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include "ast/ast_fwd.h"
@@ -23,7 +25,9 @@ struct Decl {
   Decl(Kind kind, std::string_view name) : kind{kind}, name{name} {}
 
  public:
-  static bool update_users;
+  /// Whether nodes referring to a declaration register themselves in its `users`; per thread so
+  /// that a loader can turn it off without affecting other threads.
+  static thread_local bool update_users;
 
   const Kind kind;
   std::string name;
@@ -38,7 +42,7 @@ struct Decl {
 
   META_INFO(Decl, 0, void, name, TRANSIENT_FIELD(users));
 };
-inline bool Decl::update_users = true;
+inline thread_local bool Decl::update_users = true;
 
 struct CompilationUnitDecl : Decl {
   std::vector<Decl *> decls;
@@ -57,7 +61,20 @@ struct VarDecl : Decl {
   VarDecl(std::string_view name, Type *type, Expr *init_val = nullptr)
       : Decl{Kind::kVarDecl, name}, type{type}, init_val{init_val} {}
 
-  META_INFO(VarDecl, Kind::kVarDecl, Decl, type);
+  META_INFO(VarDecl, Kind::kVarDecl, Decl, type, init_val);
+};
+
+/// Decodes on first use the nodes that a lazily loaded snapshot left out, see
+/// `serde::LoadMode::kLazy`.
+class LazySource {
+ public:
+  virtual ~LazySource() = default;
+
+  /// Decodes the `BlockExpr` in slot `index`, and the nodes it refers to, into their pools.
+  virtual BlockExpr *load_block(std::uint32_t index) = 0;
+
+  /// Decodes every node still in the snapshot, reachable from a function body or not.
+  virtual void load_all() = 0;
 };
 
 struct FuncDecl : Decl {
@@ -69,6 +86,9 @@ struct FuncDecl : Decl {
   std::vector<std::tuple<std::string, Type *>> params;
   Type *return_type;
   BlockExpr *body;
+  /// When set, `body` is still in a snapshot, in slot `lazy_body_index`; `get_body` loads it.
+  LazySource *lazy_source{nullptr};
+  std::uint32_t lazy_body_index{0};
 
   FuncDecl() : FuncDecl{"", {}, nullptr, nullptr} {}
   FuncDecl(std::string_view name, const std::vector<ParamSpec> &param_specs, Type *return_type,
@@ -82,6 +102,13 @@ struct FuncDecl : Decl {
 
   // void add_stmt(Stmt *stmt);
 
+  /// `body`, loaded first if it is still in a snapshot. Not synchronized.
+  BlockExpr *get_body() {
+    if (lazy_source)
+      body = std::exchange(lazy_source, nullptr)->load_block(lazy_body_index);
+    return body;
+  }
+
   META_INFO(FuncDecl, Kind::kFuncDecl, Decl, params, return_type, body);
 };
 
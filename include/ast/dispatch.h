@@ -0,0 +1,107 @@
+#ifndef AST_DISPATCH__H
+#define AST_DISPATCH__H
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "ast/ast_fwd.h"
+#include "ast/decl.h"
+#include "ast/expr.h"
+#include "ast/stmt.h"
+#include "ast/type.h"
+
+namespace ast {
+template <typename T>
+struct TypeTag {
+  using type = T;
+};
+
+/// Number of concrete node classes, i.e. `Nodes` without the trailing `void`.
+inline constexpr std::size_t kNumNodeClasses = std::tuple_size_v<Nodes> - 1;
+
+namespace detail {
+template <typename T, std::size_t I = 0>
+constexpr std::size_t node_ordinal() {
+  if constexpr (I == kNumNodeClasses)
+    return kNumNodeClasses;
+  else if constexpr (std::is_same_v<T, std::tuple_element_t<I, Nodes>>)
+    return I;
+  else
+    return node_ordinal<T, I + 1>();
+}
+
+/// Class IDs are `<group> * 1000 + <n>`, one group per `Kind` enum.
+inline constexpr std::size_t kClassIDGroups = 4;
+inline constexpr std::size_t kClassIDGroupSize = 16;
+
+constexpr std::size_t class_id_slot(int class_id) {
+  return (class_id / 1000 - 1) * kClassIDGroupSize + class_id % 1000 - 1;
+}
+
+template <std::size_t... Is>
+constexpr auto make_ordinal_table(std::index_sequence<Is...>) {
+  std::array<std::uint8_t, kClassIDGroups * kClassIDGroupSize> table{};
+  ((table[class_id_slot(std::tuple_element_t<Is, Nodes>::kClassID)] = Is), ...);
+  return table;
+}
+
+inline constexpr auto kOrdinalTable =
+    make_ordinal_table(std::make_index_sequence<kNumNodeClasses>{});
+
+template <typename F, std::size_t... Is>
+void with_node_class_impl(std::size_t ordinal, F &&func, std::index_sequence<Is...>) {
+  ((ordinal == Is ? (func(TypeTag<std::tuple_element_t<Is, Nodes>>{}), true) : false) || ...);
+}
+}  // namespace detail
+
+/// Position of `T` in `Nodes`.
+template <typename T>
+inline constexpr std::size_t kNodeOrdinal = detail::node_ordinal<T>();
+
+template <typename T>
+inline constexpr bool is_concrete_node_v = kNodeOrdinal<T> < kNumNodeClasses;
+
+inline std::size_t ordinal_of_class_id(int class_id) {
+  return detail::kOrdinalTable[detail::class_id_slot(class_id)];
+}
+
+/// Position in `Nodes` of the dynamic class of `node`, found from its `kind`.
+template <typename T>
+std::size_t ordinal_of(const T &node) {
+  if constexpr (is_concrete_node_v<T>)
+    return kNodeOrdinal<T>;
+  else
+    return ordinal_of_class_id(static_cast<int>(node.kind));
+}
+
+/// Calls `func(TypeTag<C>{})`, where `C` is the `ordinal`-th class of `Nodes`.
+template <typename F>
+void with_node_class(std::size_t ordinal, F &&func) {
+  assert(ordinal < kNumNodeClasses);
+  detail::with_node_class_impl(ordinal, func, std::make_index_sequence<kNumNodeClasses>{});
+}
+
+/// Calls `func(C *)` with `node` downcast to its dynamic class `C`.
+template <typename T, typename F>
+void visit_concrete(T *node, F &&func) {
+  using U = std::remove_const_t<T>;
+  if constexpr (is_concrete_node_v<U>) {
+    func(node);
+  } else {
+    with_node_class(ordinal_of(*node), [node, &func](auto tag) {
+      using C = typename decltype(tag)::type;
+      if constexpr (std::is_base_of_v<U, C>)
+        func(static_cast<std::conditional_t<std::is_const_v<T>, const C, C> *>(node));
+      else
+        assert(false && "kind does not match the static type");
+    });
+  }
+}
+}  // namespace ast
+
+#endif  // AST_DISPATCH__H
@@ -65,7 +65,7 @@ struct DeclRefExpr : Expr {
 
   DeclRefExpr() : DeclRefExpr{nullptr} {}
   DeclRefExpr(Decl *decl);
-  DeclRefExpr(std::string_view name) : Expr{Kind::kDeclRefExpr}, name{name} {}
+  DeclRefExpr(std::string_view name) : Expr{Kind::kDeclRefExpr}, decl{nullptr}, name{name} {}
 
   META_INFO(DeclRefExpr, Kind::kDeclRefExpr, Expr, REF_FIELD(decl), name);
 };
@@ -78,7 +78,7 @@ struct MemberExpr : Expr {
   MemberExpr() : MemberExpr{nullptr, nullptr} {}
   MemberExpr(Expr *prefix, Decl *target);
   MemberExpr(Expr *prefix, std::string_view name)
-      : Expr{Kind::kMemberExpr}, prefix{prefix}, name{name} {}
+      : Expr{Kind::kMemberExpr}, prefix{prefix}, target{nullptr}, name{name} {}
 
   META_INFO(MemberExpr, Kind::kMemberExpr, Expr, prefix, REF_FIELD(target), name);
 };
@@ -0,0 +1,116 @@
+#ifndef AST_NODE_REF__H
+#define AST_NODE_REF__H
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#include "ast/context.h"
+#include "ast/dispatch.h"
+#include "pool.h"
+
+namespace ast {
+/// A 32-bit reference to a node in a `Pool`, a compact alternative to a child pointer.
+///
+/// The upper `kOrdinalBits` bits hold the concrete class of the node (its position in `Nodes`, plus
+/// one so that zero is null), the rest its slot index. `NodeRef<Expr>` can thus refer to any
+/// expression. It does not depend on where the pools live, so it is serialized as is and is
+/// resolved against the `ASTContext` it belongs to.
+template <typename T>
+class NodeRef {
+ public:
+  static constexpr unsigned kOrdinalBits = 5;
+  static constexpr unsigned kIndexBits = 32 - kOrdinalBits;
+  static constexpr std::uint32_t kIndexMask = (std::uint32_t{1} << kIndexBits) - 1;
+  static_assert(kNumNodeClasses < (1u << kOrdinalBits));
+
+ public:
+  NodeRef() = default;
+  NodeRef(std::nullptr_t) {}
+  explicit NodeRef(T *node) {
+    if (!node)
+      return;
+    visit_concrete(node, [this](auto *concrete) {
+      using C = std::remove_const_t<std::remove_pointer_t<decltype(concrete)>>;
+      _raw = pack(kNodeOrdinal<C>, Pool<C>::index_of(concrete));
+    });
+  }
+  template <typename U, typename = std::enable_if_t<std::is_base_of_v<T, U>>>
+  NodeRef(NodeRef<U> other) : _raw{other.raw()} {}
+
+  static NodeRef from_raw(std::uint32_t raw) {
+    NodeRef ref;
+    ref._raw = raw;
+    return ref;
+  }
+
+ public:
+  std::uint32_t raw() const {
+    return _raw;
+  }
+  std::size_t ordinal() const {
+    assert(_raw);
+    return (_raw >> kIndexBits) - 1;
+  }
+  std::size_t index() const {
+    return _raw & kIndexMask;
+  }
+
+  explicit operator bool() const {
+    return _raw != 0;
+  }
+
+  T *get(ASTContext &ctx) const {
+    if (!_raw)
+      return nullptr;
+    if constexpr (is_concrete_node_v<T>) {
+      assert(ordinal() == kNodeOrdinal<T>);
+      return &ctx.pool<T>().at(index());
+    } else {
+      T *node = nullptr;
+      with_node_class(ordinal(), [this, &ctx, &node](auto tag) {
+        using C = typename decltype(tag)::type;
+        if constexpr (std::is_base_of_v<T, C>)
+          node = &ctx.pool<C>().at(index());
+      });
+      assert(node && "referenced class is not a T");
+      return node;
+    }
+  }
+
+  T *get() const {
+    return get(ASTContext::global());
+  }
+
+  T &operator*() const {
+    return *get();
+  }
+  T *operator->() const {
+    return get();
+  }
+
+  friend bool operator==(NodeRef lhs, NodeRef rhs) {
+    return lhs._raw == rhs._raw;
+  }
+  friend bool operator!=(NodeRef lhs, NodeRef rhs) {
+    return lhs._raw != rhs._raw;
+  }
+
+ private:
+  static std::uint32_t pack(std::size_t ordinal, std::size_t index) {
+    assert(index <= kIndexMask);
+    return static_cast<std::uint32_t>((ordinal + 1) << kIndexBits | index);
+  }
+
+ private:
+  std::uint32_t _raw{0};
+};
+
+template <typename T>
+NodeRef<T> make_ref(T *node) {
+  return NodeRef<T>{node};
+}
+}  // namespace ast
+
+#endif  // AST_NODE_REF__H
@@ -76,7 +76,7 @@ struct ClassType : Type {
   ClassType(ClassDecl *cls) : Type{Kind::kClassType}, cls{cls} {}
   ClassType(std::string_view name) : Type{Kind::kClassType}, name{name}, cls{nullptr} {}
 
-  META_INFO(ClassType, Kind::kClassType, Type, REF_FIELD(cls));
+  META_INFO(ClassType, Kind::kClassType, Type, REF_FIELD(cls), name);
 };
 
 struct ListType : Type {
@@ -0,0 +1,197 @@
+#ifndef COLUMNAR_POOL__H
+#define COLUMNAR_POOL__H
+
+#include <cassert>
+#include <cstddef>
+#include <functional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "ast/decl.h"
+#include "reflect/access.h"
+#include "reflect/model.h"
+#include "utility/save_restore.h"
+
+namespace ast::detail {
+/// The fields in `Fields` that are not `TRANSIENT_FIELD`s.
+template <typename Fields>
+struct StoredFields;
+template <typename... Fs>
+struct StoredFields<std::tuple<Fs...>> {
+  using type = decltype(std::tuple_cat(
+      std::declval<std::conditional_t<Fs::is_transient, std::tuple<>, std::tuple<Fs>>>()...));
+};
+
+/// All non-transient fields of `T`, those of its super classes first.
+template <typename T, typename = void>
+struct AllFields {
+  using type = decltype(std::tuple_cat(
+      std::declval<typename AllFields<typename reflect::Access<T>::super_type>::type>(),
+      std::declval<typename StoredFields<typename T::field_list::tuple>::type>()));
+};
+
+template <typename T>
+struct AllFields<T, std::enable_if_t<std::is_void_v<T>>> {
+  using type = std::tuple<>;
+};
+
+template <typename Fields, auto P, std::size_t I = 0>
+constexpr std::size_t index_of_field() {
+  static_assert(I < std::tuple_size_v<Fields>, "not a reflected field");
+  using Field = std::tuple_element_t<I, Fields>;
+  if constexpr (std::is_same_v<std::remove_const_t<decltype(Field::pointer)>, decltype(P)>) {
+    if constexpr (Field::pointer == P)
+      return I;
+    else
+      return index_of_field<Fields, P, I + 1>();
+  } else {
+    return index_of_field<Fields, P, I + 1>();
+  }
+}
+}  // namespace ast::detail
+
+namespace ast {
+/// Struct-of-arrays storage for nodes of type `T`.
+///
+/// Every reflected field of `T` (including inherited ones) lives in its own contiguous column, so
+/// a pass that reads one field of every node streams through that column only; transient fields
+/// such as `Decl::users` are not stored. Nodes are addressed by index; `Ref` is a proxy to one row
+/// and `load`/`store` convert from and to a whole `T`.
+///
+/// Rows are not nodes of a `Pool`: the nodes that `emplace` and `load` build on the way do not
+/// register themselves in `Decl::users`.
+template <typename T>
+class ColumnarPool final {
+ public:
+  using fields = typename detail::AllFields<T>::type;
+  static constexpr std::size_t kNumColumns = std::tuple_size_v<fields>;
+  static_assert(kNumColumns > 0, "nodes without fields have nothing to store in columns");
+
+  template <std::size_t I>
+  using column_type = typename std::tuple_element_t<I, fields>::type;
+
+  /// Index of the column holding the field `P`, e.g. `&BinaryExpr::op`.
+  template <auto P>
+  static constexpr std::size_t kColumnOf = detail::index_of_field<fields, P>();
+
+ public:
+  class Ref {
+   public:
+    Ref(ColumnarPool &pool, std::size_t i) : _pool{pool}, _i{i} {}
+
+    std::size_t index() const {
+      return _i;
+    }
+
+    template <std::size_t I>
+    column_type<I> &get() const {
+      return _pool.template column<I>()[_i];
+    }
+    template <auto P, typename = std::enable_if_t<std::is_member_object_pointer_v<decltype(P)>>>
+    auto &get() const {
+      return get<kColumnOf<P>>();
+    }
+
+    T load() const {
+      return _pool.load(_i);
+    }
+    void store(const T &node) const {
+      _pool.store(_i, node);
+    }
+
+   private:
+    ColumnarPool &_pool;
+    std::size_t _i;
+  };
+
+ public:
+  std::size_t size() const {
+    return std::get<0>(_columns).size();
+  }
+
+  void reserve(std::size_t n) {
+    std::apply([n](auto &...cols) { (cols.reserve(n), ...); }, _columns);
+  }
+
+  void clear() {
+    std::apply([](auto &...cols) { (cols.clear(), ...); }, _columns);
+  }
+
+  /// Appends the fields of `node` and returns its index.
+  std::size_t push_back(const T &node) {
+    std::apply([](auto &...cols) { (cols.emplace_back(), ...); }, _columns);
+    const std::size_t i = size() - 1;
+    store(i, node);
+    return i;
+  }
+
+  template <typename... Args>
+  Ref emplace(Args &&...args) {
+    SAVE_RESTORE(Decl::update_users, false);
+    return (*this)[push_back(T(std::forward<Args>(args)...))];
+  }
+
+  Ref operator[](std::size_t i) {
+    assert(i < size());
+    return Ref{*this, i};
+  }
+
+  template <std::size_t I>
+  std::vector<column_type<I>> &column() {
+    return std::get<I>(_columns);
+  }
+  template <std::size_t I>
+  const std::vector<column_type<I>> &column() const {
+    return std::get<I>(_columns);
+  }
+  template <auto P, typename = std::enable_if_t<std::is_member_object_pointer_v<decltype(P)>>>
+  auto &column() {
+    return column<kColumnOf<P>>();
+  }
+
+  /// Gathers row `i` into a whole node.
+  T load(std::size_t i) const {
+    SAVE_RESTORE(Decl::update_users, false);
+    T node;
+    gather(i, node, std::make_index_sequence<kNumColumns>{});
+    return node;
+  }
+
+  /// Scatters `node` into row `i`.
+  void store(std::size_t i, const T &node) {
+    scatter(i, node, std::make_index_sequence<kNumColumns>{});
+  }
+
+  template <typename F>
+  void for_each(F &&func) {
+    for (std::size_t i = 0, n = size(); i < n; i++) {
+      std::invoke(func, i, Ref{*this, i});
+    }
+  }
+
+ private:
+  template <std::size_t... Is>
+  void gather(std::size_t i, T &node, std::index_sequence<Is...>) const {
+    ((node.*std::tuple_element_t<Is, fields>::pointer = std::get<Is>(_columns)[i]), ...);
+  }
+
+  template <std::size_t... Is>
+  void scatter(std::size_t i, const T &node, std::index_sequence<Is...>) {
+    ((std::get<Is>(_columns)[i] = node.*std::tuple_element_t<Is, fields>::pointer), ...);
+  }
+
+  template <typename Fields>
+  struct Columns;
+  template <typename... Fs>
+  struct Columns<std::tuple<Fs...>> {
+    using type = std::tuple<std::vector<typename Fs::type>...>;
+  };
+
+ private:
+  typename Columns<fields>::type _columns;
+};
+}  // namespace ast
+
+#endif  // COLUMNAR_POOL__H
@@ -1,84 +1,559 @@
 #ifndef MEM_POOL__H
 #define MEM_POOL__H
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
-#include <iterator>
-#include <list>
 #include <memory>
-#include <unordered_map>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "reflect/heap_size.h"
+#include "utility/thread_pool.h"
 
 namespace ast {
+/// Memory usage of one `Pool`.
+struct PoolStats {
+  std::size_t num_nodes{0};
+  /// Slots handed out so far, live or not.
+  std::size_t num_slots{0};
+  /// Slots in the chunks allocated so far.
+  std::size_t capacity{0};
+  /// Memory held by the chunks, slot headers included.
+  std::size_t bytes_reserved{0};
+  /// `sizeof` of the live nodes.
+  std::size_t bytes_used{0};
+  /// Heap memory owned by the live nodes' members (strings, vectors, ...).
+  std::size_t heap_bytes{0};
+
+  /// Share of handed-out slots that do not hold a node.
+  double fragmentation() const {
+    return num_slots ? 1.0 - static_cast<double>(num_nodes) / num_slots : 0.0;
+  }
+
+  PoolStats &operator+=(const PoolStats &other) {
+    num_nodes += other.num_nodes;
+    num_slots += other.num_slots;
+    capacity += other.capacity;
+    bytes_reserved += other.bytes_reserved;
+    bytes_used += other.bytes_used;
+    heap_bytes += other.heap_bytes;
+    return *this;
+  }
+};
+
+/// A chunked slab arena.
+///
+/// Slots live in chunks whose sizes grow geometrically (`kFirstChunkSize`, twice that, ...), so a
+/// node never moves once created and the chunk holding slot `i` is found with one bit scan. Every
+/// slot carries a small header, which is how `destroy` and `index_of` find it from a node address.
+///
+/// Slot indices are stable: `for_each` passes them in increasing order and `at(i)` is the node in
+/// slot `i`. Destroyed slots are skipped by `for_each` and kept on an intrusive free list, so the
+/// next `create` reuses them instead of growing the pool. Every slot also counts how many times it
+/// has been destroyed; a `Handle` records that generation and goes stale once its node is gone.
+///
+/// Pools are owned by an `ASTContext`; `instance()` is the pool of the global one. Destroying a
+/// pool frees its chunks in bulk and only runs node destructors when they are not trivial.
+///
+/// Pools also track which slots changed since `clear_dirty`, for incremental saving: `create`,
+/// `destroy` and new slots mark theirs, and code that modifies a node in place calls `mark_dirty`.
+/// Until the first `clear_dirty`, and after `clear` or a compaction, the whole pool is dirty.
+///
+/// `create` and `destroy` are not synchronized. To build nodes from several threads, give each
+/// thread its own `Magazine`: it takes slots from the pool in batches under a lock and constructs
+/// nodes without one. `for_each` and `num_nodes` are consistent once every magazine is gone.
+///
 /// This implementation is not exception-safe, just for illustration.
 template <typename T>
 class Pool final {
+ public:
+  static constexpr std::size_t kFirstChunkSize = 64;
+  /// Enough chunks to cover every 32-bit slot index.
+  static constexpr std::size_t kMaxChunks = 26;
+  static constexpr std::size_t kMagazineSize = 256;
+  /// How many slots ahead `for_each_prefetch` looks by default.
+  static constexpr std::size_t kPrefetchDistance = 8;
+
+  /// A generation-checked reference to a node, see `handle_of` and `get`.
+  struct Handle {
+    std::uint32_t index;
+    std::uint32_t generation;
+
+    friend bool operator==(Handle lhs, Handle rhs) {
+      return lhs.index == rhs.index && lhs.generation == rhs.generation;
+    }
+    friend bool operator!=(Handle lhs, Handle rhs) {
+      return !(lhs == rhs);
+    }
+  };
+
  private:
+  static constexpr std::uint32_t kNoSlot = ~std::uint32_t{0};
+
+  struct Slot {
+    alignas(T) unsigned char storage[sizeof(T)];
+    std::uint32_t index;
+    std::uint32_t generation;
+    /// Next slot on the free list, only meaningful when the slot is not live.
+    std::uint32_t next_free;
+    bool live;
+    /// Whether the slot is in `_dirty_slots`.
+    bool dirty;
+  };
+
+ public:
+  /// Distance between two consecutive nodes of a chunk.
+  static constexpr std::size_t kSlotSize = sizeof(Slot);
+
+ public:
   Pool() = default;
   Pool(const Pool &) = delete;
   Pool(Pool &&) = delete;
   Pool &operator=(const Pool &) = delete;
   Pool &operator=(Pool &&) = delete;
-  ~Pool() = default;
-
- public:
-  static Pool &instance() {
-    static Pool singleton;
-    return singleton;
+  ~Pool() {
+    clear();
   }
 
+  /// The pool of `ASTContext::global()`. Defined in ast/context.h, which every file calling it
+  /// must include: the definition is a template, so nothing else instantiates it.
+  static Pool &instance();
+
  public:
   template <typename... Args>
   T *create(Args &&...args) {
-    _data.emplace_front(std::forward<Args>(args)...);
-    auto it = _data.begin();
-    _index.emplace(std::addressof(*it), it);
-    return std::addressof(*it);
+    Slot &slot = new_slot();
+    T *ptr = ::new (static_cast<void *>(slot.storage)) T(std::forward<Args>(args)...);
+    slot.live = true;
+    _num_live++;
+    return ptr;
   }
 
   void destroy(T *ptr) {
-    auto it = _index.find(ptr);
-    assert(it != _index.end());
-    auto jt = it->second;
-    _index.erase(it);
-    _data.erase(jt);
+    Slot &slot = slot_of(ptr);
+    assert(slot.live);
+    ptr->~T();
+    slot.live = false;
+    slot.generation++;
+    slot.next_free = _free_head;
+    _free_head = slot.index;
+    _num_live--;
+    mark_dirty(slot);
   }
 
+  /// Records that `ptr` was modified in place since the last `clear_dirty`.
+  void mark_dirty(const T *ptr) {
+    mark_dirty(slot_of(ptr));
+  }
+
+  /// Whether every slot counts as changed, see the class comment.
+  bool all_dirty() const {
+    return _all_dirty;
+  }
+
+  /// Calls `func(std::size_t index)` for every slot changed since the last `clear_dirty`, live or
+  /// not, in no particular order. Not meaningful when `all_dirty`.
+  template <typename F>
+  void for_each_dirty(F &&func) const {
+    for (auto i : _dirty_slots)
+      std::invoke(func, std::size_t{i});
+  }
+
+  std::size_t num_dirty() const {
+    return _all_dirty ? _num_slots : _dirty_slots.size();
+  }
+
+  /// Forgets the changes so far, e.g. once they are saved.
+  void clear_dirty() {
+    for (auto i : _dirty_slots) {
+      const auto [k, j] = locate(i);
+      _chunks[k][j].dirty = false;
+    }
+    _dirty_slots.clear();
+    _all_dirty = false;
+  }
+
+  /// Counts every slot as changed again, e.g. when saving the changes failed after all.
+  void mark_all_dirty() {
+    clear_dirty();
+    _all_dirty = true;
+  }
+
+  Handle handle_of(const T *ptr) const {
+    const Slot &slot = slot_of(ptr);
+    assert(slot.live);
+    return {slot.index, slot.generation};
+  }
+
+  /// Returns nullptr if the node `h` refers to has been destroyed, even if its slot is reused.
+  T *get(Handle h) {
+    if (h.index >= _num_slots)
+      return nullptr;
+    const auto [k, j] = locate(h.index);
+    Slot &slot = _chunks[k][j];
+    if (!slot.live || slot.generation != h.generation)
+      return nullptr;
+    return node_of(slot);
+  }
+
+  /// Like `get`, but a stale handle is a bug.
+  T &deref(Handle h) {
+    T *ptr = get(h);
+    assert(ptr && "stale handle");
+    return *ptr;
+  }
+
+  /// A per-thread cache of reserved slots, see the class comment.
+  class Magazine {
+   public:
+    explicit Magazine(Pool &pool, std::size_t batch = kMagazineSize) : _pool{pool}, _batch{batch} {
+      _slots.reserve(batch);
+    }
+    Magazine(const Magazine &) = delete;
+    Magazine &operator=(const Magazine &) = delete;
+    ~Magazine() {
+      _pool.put_back(_slots, _num_created);
+    }
+
+    template <typename... Args>
+    T *create(Args &&...args) {
+      if (_slots.empty()) {
+        _pool.take(_slots, _batch, _num_created);
+        _num_created = 0;
+      }
+      Slot &slot = *_slots.back();
+      _slots.pop_back();
+      T *ptr = ::new (static_cast<void *>(slot.storage)) T(std::forward<Args>(args)...);
+      slot.live = true;
+      _num_created++;
+      return ptr;
+    }
+
+   private:
+    Pool &_pool;
+    std::size_t _batch;
+    /// Reserved slots, the next one to use at the back.
+    std::vector<Slot *> _slots;
+    /// Nodes created since the last trip to the pool.
+    std::size_t _num_created{0};
+  };
+
   template <typename F>
   void for_each(F &&func) {
-    std::size_t i = 0;
-    for (auto &x : _data) {
-      std::invoke(std::forward<F>(func), i, x);
-      i++;
+    for (std::size_t k = 0, base = 0; base < _num_slots; base += chunk_size(k), k++) {
+      Slot *chunk = _chunks[k].get();
+      const std::size_t n = std::min(chunk_size(k), _num_slots - base);
+      for (std::size_t j = 0; j < n; j++) {
+        if (chunk[j].live)
+          std::invoke(func, base + j, *node_of(chunk[j]));
+      }
     }
   }
 
+  /// Like `for_each`, but calls `ahead(node)` on the live node `distance` slots ahead of the
+  /// current one first. `ahead` should issue prefetches for whatever `func` will dereference, e.g.
+  /// the node's children; by default it prefetches the node itself.
+  template <typename F, typename G,
+            typename = std::enable_if_t<std::is_invocable_v<G &, const T &>>>
+  void for_each_prefetch(F &&func, G &&ahead, std::size_t distance = kPrefetchDistance) {
+    for (std::size_t k = 0, base = 0; base < _num_slots; base += chunk_size(k), k++) {
+      Slot *chunk = _chunks[k].get();
+      const std::size_t n = std::min(chunk_size(k), _num_slots - base);
+      for (std::size_t j = 0; j < n; j++) {
+        if (j + distance < n && chunk[j + distance].live)
+          std::invoke(ahead, static_cast<const T &>(*node_of(chunk[j + distance])));
+        if (chunk[j].live)
+          std::invoke(func, base + j, *node_of(chunk[j]));
+      }
+    }
+  }
+  template <typename F>
+  void for_each_prefetch(F &&func, std::size_t distance = kPrefetchDistance) {
+    for_each_prefetch(
+        std::forward<F>(func), [](const T &node) { __builtin_prefetch(&node); }, distance);
+  }
+
+  /// Like `for_each`, but runs `func` on `workers` for slot ranges of about `grain` slots at a
+  /// time, so `func` must be safe to call concurrently. Node order across ranges is unspecified.
+  template <typename F>
+  void parallel_for_each(
+      F &&func, std::size_t grain = kFirstChunkSize * 16,
+      utility::concurrency::ThreadPool &workers = utility::concurrency::ThreadPool::shared()) {
+    utility::concurrency::parallel_for(
+        _num_slots, grain,
+        [this, &func](std::size_t begin, std::size_t end) {
+          while (begin < end) {
+            const auto [k, j] = locate(begin);
+            Slot *chunk = _chunks[k].get();
+            const std::size_t n = std::min(chunk_size(k) - j, end - begin);
+            for (std::size_t m = 0; m < n; m++) {
+              if (chunk[j + m].live)
+                std::invoke(func, begin + m, *node_of(chunk[j + m]));
+            }
+            begin += n;
+          }
+        },
+        workers);
+  }
+
+  /// Appends default-constructed nodes until there are at least `n` live ones.
   void reserve(std::size_t n) {
-    if (n > _data.size())
-      _data.resize(n);
+    while (_num_live < n)
+      create();
+  }
+
+  /// Appends `n` raw slots without constructing anything in them and returns the index of the
+  /// first one. Each slot must then be filled with `construct_at` or `construct_with`; until
+  /// then it is skipped by `for_each`.
+  std::size_t allocate(std::size_t n) {
+    const std::size_t first = _num_slots;
+    for (std::size_t i = 0; i < n; i++)
+      new_fresh_slot();
+    return first;
+  }
+
+  template <typename... Args>
+  T *construct_at(std::size_t i, Args &&...args) {
+    return construct_with(i, [&args...](void *storage) {
+      return ::new (storage) T(std::forward<Args>(args)...);
+    });
+  }
+
+  /// Fills slot `i` with `init(void *storage)`, which must placement-new a `T` there and return it.
+  template <typename F>
+  T *construct_with(std::size_t i, F &&init) {
+    assert(i < _num_slots);
+    const auto [k, j] = locate(i);
+    Slot &slot = _chunks[k][j];
+    assert(!slot.live);
+    T *ptr = std::invoke(std::forward<F>(init), static_cast<void *>(slot.storage));
+    slot.live = true;
+    _num_live++;
+    return ptr;
+  }
+
+  /// Puts slot `i`, allocated but never constructed, on the free list.
+  void release(std::size_t i) {
+    assert(i < _num_slots);
+    const auto [k, j] = locate(i);
+    Slot &slot = _chunks[k][j];
+    assert(!slot.live);
+    slot.next_free = _free_head;
+    _free_head = slot.index;
   }
 
   std::size_t num_nodes() const {
-    return _data.size();
+    return _num_live;
+  }
+
+  /// Number of slots ever handed out, including the ones on the free list.
+  std::size_t num_slots() const {
+    return _num_slots;
+  }
+
+  /// Whether slot `i` holds a node.
+  bool is_live(std::size_t i) const {
+    if (i >= _num_slots)
+      return false;
+    const auto [k, j] = locate(i);
+    return _chunks[k][j].live;
   }
 
   const T &at(std::size_t i) const {
-    auto it = _data.begin();
-    std::advance(it, i);
-    return *it;
+    assert(i < _num_slots);
+    const auto [k, j] = locate(i);
+    const Slot &slot = _chunks[k][j];
+    assert(slot.live);
+    return *node_of(slot);
   }
   T &at(std::size_t i) {
     return const_cast<T &>(static_cast<const Pool *>(this)->at(i));
   }
 
+  static std::size_t index_of(const T *ptr) {
+    return slot_of(ptr).index;
+  }
+
+  /// A dense layout prepared by `begin_compaction`.
+  class Compaction {
+   public:
+    std::size_t new_index(std::size_t old_index) const {
+      assert(_new_index[old_index] != kNoSlot);
+      return _new_index[old_index];
+    }
+    /// Where the live node now in slot `old_index` will be after `finish_compaction`.
+    T *new_address(std::size_t old_index) const {
+      const auto [k, j] = locate(new_index(old_index));
+      return node_of(_chunks[k][j]);
+    }
+
+   private:
+    friend class Pool;
+    std::array<std::unique_ptr<Slot[]>, kMaxChunks> _chunks;
+    std::vector<std::uint32_t> _order;
+    std::vector<std::uint32_t> _new_index;
+  };
+
+  /// Compaction happens in two steps so that callers can redirect pointers in between. This one
+  /// allocates a dense layout in which the live node now in slot `order[i]` will go to slot `i`;
+  /// `finish_compaction` moves the nodes there and frees the old chunks. `order` must list every
+  /// live slot exactly once. Slot indices and handles are not preserved.
+  Compaction begin_compaction(std::vector<std::uint32_t> order) {
+    assert(order.size() == _num_live);
+    Compaction c;
+    c._new_index.assign(_num_slots, kNoSlot);
+    for (std::size_t i = 0; i < order.size(); i++)
+      c._new_index[order[i]] = static_cast<std::uint32_t>(i);
+    for (std::size_t k = 0, base = 0; base < order.size(); base += chunk_size(k), k++)
+      c._chunks[k].reset(new Slot[chunk_size(k)]);
+    c._order = std::move(order);
+    return c;
+  }
+
+  void finish_compaction(Compaction &&c) {
+    for (std::size_t i = 0; i < c._order.size(); i++) {
+      const auto [ok, oj] = locate(c._order[i]);
+      Slot &from = _chunks[ok][oj];
+      assert(from.live);
+      const auto [k, j] = locate(i);
+      Slot &to = c._chunks[k][j];
+      ::new (static_cast<void *>(to.storage)) T(std::move(*node_of(from)));
+      to.index = static_cast<std::uint32_t>(i);
+      to.generation = 0;
+      to.live = true;
+      to.dirty = false;
+      node_of(from)->~T();
+      from.live = false;
+    }
+    _chunks = std::move(c._chunks);
+    _num_slots = c._order.size();
+    _num_live = c._order.size();
+    _free_head = kNoSlot;
+    _dirty_slots.clear();
+    _all_dirty = true;
+  }
+
+  /// Calls `func(const void *first, std::size_t first_index, std::size_t n)` for every chunk with
+  /// slots handed out; the slots are `kSlotSize` bytes apart.
+  template <typename F>
+  void for_each_chunk(F &&func) const {
+    for (std::size_t k = 0, base = 0; base < _num_slots; base += chunk_size(k), k++) {
+      const std::size_t n = std::min(chunk_size(k), _num_slots - base);
+      std::invoke(func, static_cast<const void *>(_chunks[k].get()), base, n);
+    }
+  }
+
+  /// Walks every live node to add up the heap memory it owns.
+  PoolStats stats() {
+    PoolStats s;
+    s.num_nodes = _num_live;
+    s.num_slots = _num_slots;
+    for (std::size_t k = 0; k < kMaxChunks && _chunks[k]; k++)
+      s.capacity += chunk_size(k);
+    s.bytes_reserved = s.capacity * sizeof(Slot);
+    s.bytes_used = _num_live * sizeof(T);
+    for_each([&s](std::size_t, const T &node) { s.heap_bytes += reflect::heap_bytes(node); });
+    return s;
+  }
+
   void clear() {
-    _index.clear();
-    _data.clear();
+    if constexpr (!std::is_trivially_destructible_v<T>)
+      for_each([](std::size_t, T &node) { node.~T(); });
+    for (auto &chunk : _chunks)
+      chunk.reset();
+    _num_slots = 0;
+    _num_live = 0;
+    _free_head = kNoSlot;
+    _dirty_slots.clear();
+    _all_dirty = true;
+  }
+
+ private:
+  static constexpr std::size_t chunk_size(std::size_t k) {
+    return kFirstChunkSize << k;
+  }
+
+  /// Maps a slot index to (chunk, offset in chunk).
+  static std::pair<std::size_t, std::size_t> locate(std::size_t i) {
+    const unsigned long long j = i / kFirstChunkSize + 1;
+    const std::size_t k = sizeof(j) * 8 - 1 - __builtin_clzll(j);
+    return {k, i - kFirstChunkSize * ((std::size_t{1} << k) - 1)};
+  }
+
+  static T *node_of(const Slot &slot) {
+    return std::launder(reinterpret_cast<T *>(const_cast<unsigned char *>(slot.storage)));
+  }
+  static Slot &slot_of(const T *ptr) {
+    return *reinterpret_cast<Slot *>(const_cast<T *>(ptr));
+  }
+
+  void mark_dirty(Slot &slot) {
+    // Not worth a list while everything is dirty anyway.
+    if (_all_dirty || slot.dirty)
+      return;
+    slot.dirty = true;
+    _dirty_slots.push_back(slot.index);
+  }
+
+  /// Refills a magazine and accounts for the nodes it created since its last refill.
+  void take(std::vector<Slot *> &slots, std::size_t n, std::size_t num_created) {
+    std::lock_guard lock{_mutex};
+    _num_live += num_created;
+    for (std::size_t i = 0; i < n; i++)
+      slots.push_back(&new_slot());
+    std::reverse(slots.begin(), slots.end());
+  }
+
+  void put_back(const std::vector<Slot *> &slots, std::size_t num_created) {
+    std::lock_guard lock{_mutex};
+    _num_live += num_created;
+    for (Slot *slot : slots) {
+      slot->next_free = _free_head;
+      _free_head = slot->index;
+    }
+  }
+
+  Slot &new_slot() {
+    if (_free_head != kNoSlot) {
+      const auto [k, j] = locate(_free_head);
+      Slot &slot = _chunks[k][j];
+      _free_head = slot.next_free;
+      mark_dirty(slot);
+      return slot;
+    }
+    return new_fresh_slot();
+  }
+
+  Slot &new_fresh_slot() {
+    const auto [k, j] = locate(_num_slots);
+    assert(k < kMaxChunks);
+    if (!_chunks[k])
+      _chunks[k].reset(new Slot[chunk_size(k)]);
+    Slot &slot = _chunks[k][j];
+    slot.index = static_cast<std::uint32_t>(_num_slots++);
+    slot.generation = 0;
+    slot.live = false;
+    slot.dirty = false;
+    mark_dirty(slot);
+    return slot;
   }
 
  private:
-  /// A hash map keeping the insertion order of elements.
-  std::list<T> _data;
-  std::unordered_map<T *, decltype(_data.begin())> _index;
+  std::array<std::unique_ptr<Slot[]>, kMaxChunks> _chunks;
+  std::size_t _num_slots{0};
+  std::size_t _num_live{0};
+  std::uint32_t _free_head{kNoSlot};
+  std::vector<std::uint32_t> _dirty_slots;
+  bool _all_dirty{true};
+  /// Guards the members above against concurrent magazines.
+  std::mutex _mutex;
 };
 }  // namespace ast
 
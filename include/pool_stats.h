@@ -0,0 +1,73 @@
+#ifndef POOL_STATS__H
+#define POOL_STATS__H
+
+#include <cstddef>
+#include <iomanip>
+#include <ostream>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "ast/ast_fwd.h"
+#include "ast/context.h"
+#include "pool.h"
+#include "reflect/access.h"
+
+namespace ast {
+struct ClassPoolStats {
+  std::string_view class_name;
+  int class_id;
+  /// `sizeof` one node.
+  std::size_t node_size;
+  PoolStats stats;
+};
+
+namespace detail {
+template <std::size_t... Is>
+std::vector<ClassPoolStats> collect_pool_stats(ASTContext &ctx, std::index_sequence<Is...>) {
+  std::vector<ClassPoolStats> result;
+  result.reserve(sizeof...(Is));
+  (
+      [&ctx, &result] {
+        using T = std::tuple_element_t<Is, Nodes>;
+        result.push_back({T::kClassName, reflect::Access<T>::kClassID, reflect::Access<T>::kSize,
+                          ctx.pool<T>().stats()});
+      }(),
+      ...);
+  return result;
+}
+}  // namespace detail
+
+/// Stats of the pool of every class in `Nodes`, in that order.
+inline std::vector<ClassPoolStats> collect_pool_stats(ASTContext &ctx = ASTContext::global()) {
+  return detail::collect_pool_stats(ctx, std::make_index_sequence<std::tuple_size_v<Nodes> - 1>());
+}
+
+inline PoolStats total(const std::vector<ClassPoolStats> &xs) {
+  PoolStats sum;
+  for (const auto &x : xs)
+    sum += x.stats;
+  return sum;
+}
+
+/// One line per class that has ever allocated memory, then the total.
+inline void print_pool_stats(std::ostream &out, const std::vector<ClassPoolStats> &xs) {
+  auto row = [&out](std::string_view name, std::size_t node_size, const PoolStats &s) {
+    out << std::left << std::setw(20) << name << std::right << std::setw(6) << node_size
+        << std::setw(12) << s.num_nodes << std::setw(12) << s.num_slots << std::setw(14)
+        << s.bytes_reserved << std::setw(14) << s.bytes_used << std::setw(14) << s.heap_bytes
+        << std::setw(8) << std::fixed << std::setprecision(3) << s.fragmentation() << '\n';
+  };
+  out << std::left << std::setw(20) << "class" << std::right << std::setw(6) << "size"
+      << std::setw(12) << "nodes" << std::setw(12) << "slots" << std::setw(14) << "reserved"
+      << std::setw(14) << "used" << std::setw(14) << "heap" << std::setw(8) << "frag" << '\n';
+  for (const auto &x : xs) {
+    if (x.stats.capacity)
+      row(x.class_name, x.node_size, x.stats);
+  }
+  row("total", 0, total(xs));
+}
+}  // namespace ast
+
+#endif  // POOL_STATS__H
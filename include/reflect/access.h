@@ -29,6 +29,12 @@ struct is_ast_node {
 template <typename T>
 constexpr bool is_ast_node_v = is_ast_node<T>::value;
 
+/// Whether `T` lists its fields with `META_INFO`, as the AST nodes do.
+template <typename T, typename = void>
+constexpr bool is_reflected_v = false;
+template <typename T>
+constexpr bool is_reflected_v<T, std::void_t<typename T::field_list>> = true;
+
 template <typename T>
 struct Access {
   static constexpr auto kSize = sizeof(T);
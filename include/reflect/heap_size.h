@@ -0,0 +1,90 @@
+#ifndef REFLECT_HEAP_SIZE__H
+#define REFLECT_HEAP_SIZE__H
+
+#include <cstddef>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "reflect/access.h"
+
+namespace reflect {
+/// Heap memory owned by an object, not counting `sizeof` the object itself.
+template <typename T, typename = void>
+struct HeapSize {
+  std::size_t operator()(const T &) {
+    return 0;
+  }
+};
+
+template <typename T>
+std::size_t heap_bytes(const T &object) {
+  return HeapSize<T>{}(object);
+}
+
+template <typename T>
+struct HeapSize<const T> : HeapSize<T> {};
+
+template <>
+struct HeapSize<std::string> {
+  std::size_t operator()(const std::string &s) {
+    // Short strings live inside the object.
+    const auto *begin = reinterpret_cast<const char *>(&s);
+    if (s.data() >= begin && s.data() < begin + sizeof(s))
+      return 0;
+    return s.capacity() + 1;
+  }
+};
+
+template <typename T>
+struct HeapSize<std::vector<T>> {
+  std::size_t operator()(const std::vector<T> &xs) {
+    std::size_t n = xs.capacity() * sizeof(T);
+    for (const auto &x : xs)
+      n += heap_bytes(x);
+    return n;
+  }
+};
+
+/// An estimate: one bucket pointer per bucket and one singly-linked node per element.
+template <typename T>
+struct HeapSize<std::unordered_set<T>> {
+  std::size_t operator()(const std::unordered_set<T> &xs) {
+    std::size_t n = xs.bucket_count() * sizeof(void *) + xs.size() * (sizeof(void *) + sizeof(T));
+    for (const auto &x : xs)
+      n += heap_bytes(x);
+    return n;
+  }
+};
+
+template <typename... Ts>
+struct HeapSize<std::tuple<Ts...>> {
+  std::size_t operator()(const std::tuple<Ts...> &xs) {
+    return std::apply([](const auto &...x) { return (std::size_t{0} + ... + heap_bytes(x)); }, xs);
+  }
+};
+
+/// Walks the super classes and every field in `field_list`, transient ones included.
+template <typename T>
+struct HeapSize<T, std::enable_if_t<is_ast_node_v<T>>> {
+  std::size_t operator()(const T &object) {
+    using Access = reflect::Access<T>;
+    std::size_t n = 0;
+    if constexpr (Access::kHasSuper)
+      n += heap_bytes(static_cast<const typename Access::super_type &>(object));
+    return n + fields(object, std::make_index_sequence<Access::kNumFields>{});
+  }
+
+ private:
+  template <std::size_t... Is>
+  std::size_t fields(const T &object, std::index_sequence<Is...>) {
+    using Access = reflect::Access<T>;
+    return (std::size_t{0} + ... + heap_bytes(object.*Access::template FieldAt<Is>::pointer));
+  }
+};
+}  // namespace reflect
+
+#endif  // REFLECT_HEAP_SIZE__H
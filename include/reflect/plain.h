@@ -0,0 +1,105 @@
+#ifndef REFLECT_PLAIN__H
+#define REFLECT_PLAIN__H
+
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+#include "reflect/access.h"
+
+namespace reflect {
+/// Whether `T` is saved as its bytes: integers, `bool` and enums, but not pointers.
+template <typename T>
+inline constexpr bool is_plain_v = std::is_integral_v<T> || std::is_enum_v<T>;
+
+namespace detail {
+template <typename T, std::size_t I>
+constexpr bool is_plain_field() {
+  using Field = typename Access<T>::template FieldAt<I>;
+  return !Field::is_transient && !Field::is_static && is_plain_v<typename Field::type>;
+}
+
+template <typename T, std::size_t... Is>
+constexpr bool is_plain_node(std::index_sequence<Is...>) {
+  using A = Access<T>;
+  bool plain = ((Access<T>::template FieldAt<Is>::is_transient || is_plain_field<T, Is>()) && ...);
+  if constexpr (A::kHasSuper)
+    plain = plain && is_plain_node<typename A::super_type>(
+                         std::make_index_sequence<Access<typename A::super_type>::kNumFields>());
+  return plain;
+}
+
+template <typename T, std::size_t I>
+constexpr std::size_t plain_field_size() {
+  using Field = typename Access<T>::template FieldAt<I>;
+  return Field::is_transient ? 0 : sizeof(typename Field::type);
+}
+
+/// Total size of the saved fields of the plain node `T`, super classes included.
+template <typename T, std::size_t... Is>
+constexpr std::size_t plain_size(std::index_sequence<Is...>) {
+  using A = Access<T>;
+  std::size_t n = 0;
+  if constexpr (A::kHasSuper)
+    n = plain_size<typename A::super_type>(
+        std::make_index_sequence<Access<typename A::super_type>::kNumFields>());
+  return (n + ... + plain_field_size<T, Is>());
+}
+}  // namespace detail
+
+/// Whether every field of the node `T` that is saved, those of its super classes included, is
+/// plain; such a node holds no pointers to patch.
+template <typename T>
+inline constexpr bool is_plain_node_v =
+    detail::is_plain_node<T>(std::make_index_sequence<Access<T>::kNumFields>());
+
+/// Copies the saved fields of a plain node `T`, those of its super classes first, to and from
+/// `kSize` bytes, one after the other as they are in memory. That is how `serde` writes them in
+/// `io::Format::kFixed`, so a pool of such nodes can be saved or loaded with one copy.
+template <typename T>
+struct PlainNode {
+  static_assert(is_plain_node_v<T>, "only plain nodes are copied as bytes");
+
+  static constexpr std::size_t kSize =
+      detail::plain_size<T>(std::make_index_sequence<Access<T>::kNumFields>());
+
+  static void save(const T &node, char *out) {
+    fields<T>(node, [&out](const auto &field) {
+      std::memcpy(out, &field, sizeof(field));
+      out += sizeof(field);
+    });
+  }
+
+  static void load(const char *in, T &node) {
+    fields<T>(node, [&in](auto &field) {
+      std::memcpy(&field, in, sizeof(field));
+      in += sizeof(field);
+    });
+  }
+
+ private:
+  /// Calls `func` on every saved field of `U` in `node`, super classes first.
+  template <typename U, typename Node, typename F>
+  static void fields(Node &node, F &&func) {
+    using A = Access<U>;
+    if constexpr (A::kHasSuper)
+      fields<typename A::super_type>(node, func);
+    fields<U>(node, func, std::make_index_sequence<A::kNumFields>());
+  }
+
+  template <typename U, typename Node, typename F, std::size_t... Is>
+  static void fields(Node &node, F &func, std::index_sequence<Is...>) {
+    (field<U, Is>(node, func), ...);
+  }
+
+  template <typename U, std::size_t I, typename Node, typename F>
+  static void field(Node &node, F &func) {
+    using Field = typename Access<U>::template FieldAt<I>;
+    if constexpr (!Field::is_transient)
+      func(node.*Field::pointer);
+  }
+};
+}  // namespace reflect
+
+#endif  // REFLECT_PLAIN__H
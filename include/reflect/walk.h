@@ -0,0 +1,102 @@
+#ifndef REFLECT_WALK__H
+#define REFLECT_WALK__H
+
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "ast/ast_fwd.h"
+#include "reflect/access.h"
+
+namespace reflect {
+/// Calls `func(U *&slot, bool is_ref)` for every pointer to an AST node held by `object`, and
+/// `func(ast::NodeRef<U> &ref, bool is_ref)` for every `NodeRef`.
+///
+/// Walks the super classes first, then every non-transient field in `field_list`, looking through
+/// vectors and tuples. `is_ref` tells whether the pointer comes from a `REF_FIELD`. `object` is an
+/// AST node or any other class that lists its fields with `META_INFO`.
+template <typename T, typename F>
+void for_each_node_pointer(T &object, F &&func);
+
+namespace detail {
+template <typename T, typename = void>
+struct PointerWalker {
+  template <typename F>
+  void operator()(T &, bool, F &) {}
+};
+
+template <typename T>
+struct PointerWalker<T *, std::enable_if_t<is_ast_node_v<T>>> {
+  template <typename F>
+  void operator()(T *&ptr, bool is_ref, F &func) {
+    func(ptr, is_ref);
+  }
+};
+
+template <typename T>
+struct PointerWalker<ast::NodeRef<T>> {
+  template <typename F>
+  void operator()(ast::NodeRef<T> &ref, bool is_ref, F &func) {
+    func(ref, is_ref);
+  }
+};
+
+template <typename T>
+struct PointerWalker<std::vector<T>> {
+  template <typename F>
+  void operator()(std::vector<T> &xs, bool is_ref, F &func) {
+    for (auto &x : xs)
+      PointerWalker<T>{}(x, is_ref, func);
+  }
+};
+
+template <typename... Ts>
+struct PointerWalker<std::tuple<Ts...>> {
+  template <typename F>
+  void operator()(std::tuple<Ts...> &xs, bool is_ref, F &func) {
+    std::apply(
+        [is_ref, &func](auto &...x) {
+          (PointerWalker<std::decay_t<decltype(x)>>{}(x, is_ref, func), ...);
+        },
+        xs);
+  }
+};
+
+template <typename T>
+struct PointerWalker<T, std::enable_if_t<is_reflected_v<T>>> {
+  template <typename F>
+  void operator()(T &object, bool, F &func) {
+    using Access = reflect::Access<T>;
+    if constexpr (Access::kHasSuper) {
+      using Super = typename Access::super_type;
+      PointerWalker<Super>{}(static_cast<Super &>(object), false, func);
+    }
+    fields(object, func, std::make_index_sequence<Access::kNumFields>{});
+  }
+
+ private:
+  template <typename F, std::size_t... Is>
+  void fields(T &object, F &func, std::index_sequence<Is...>) {
+    (field<Is>(object, func), ...);
+  }
+
+  template <std::size_t I, typename F>
+  void field(T &object, F &func) {
+    using Field = typename reflect::Access<T>::template FieldAt<I>;
+    if constexpr (!Field::is_transient) {
+      using U = typename Field::type;
+      PointerWalker<U>{}(object.*Field::pointer, Field::is_ref, func);
+    }
+  }
+};
+}  // namespace detail
+
+template <typename T, typename F>
+void for_each_node_pointer(T &object, F &&func) {
+  detail::PointerWalker<T>{}(object, false, func);
+}
+}  // namespace reflect
+
+#endif  // REFLECT_WALK__H
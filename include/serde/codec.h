@@ -0,0 +1,198 @@
+#ifndef SERDE_CODEC__H
+#define SERDE_CODEC__H
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace serde {
+/// Identifies a codec in a snapshot file; never renumber.
+enum class CodecId : std::uint32_t {
+  kNone = 0,
+  kLz = 1,
+};
+
+/// Compresses independent blocks of at most `kMaxBlockSize` bytes.
+class Codec {
+ public:
+  static constexpr std::size_t kMaxBlockSize = std::size_t{1} << 16;
+
+  virtual ~Codec() = default;
+
+  virtual CodecId id() const = 0;
+
+  /// Appends the compressed form of `src[0, size)` to `out`.
+  virtual void compress(const char *src, std::size_t size, std::string &out) const = 0;
+
+  /// Decompresses `src[0, size)` into exactly `dst_size` bytes at `dst`; throws if the input is
+  /// corrupt.
+  virtual void decompress(const char *src, std::size_t size, char *dst,
+                          std::size_t dst_size) const = 0;
+};
+
+/// Stores blocks as they are.
+class NoneCodec final : public Codec {
+ public:
+  CodecId id() const override {
+    return CodecId::kNone;
+  }
+
+  void compress(const char *src, std::size_t size, std::string &out) const override {
+    out.append(src, size);
+  }
+
+  void decompress(const char *src, std::size_t size, char *dst,
+                  std::size_t dst_size) const override {
+    if (size != dst_size)
+      throw std::runtime_error("serde: corrupt block");
+    std::memcpy(dst, src, size);
+  }
+};
+
+/// A byte-oriented LZ77 codec in the spirit of LZ4: fast, no entropy coding.
+///
+/// A block is a series of sequences, each a token (literal count in the high nibble, match length
+/// minus `kMinMatch` in the low one, 15 meaning more bytes of 255 follow), the literals, then a
+/// 16-bit little-endian match offset. The last sequence has literals only.
+class LzCodec final : public Codec {
+ public:
+  static constexpr std::size_t kMinMatch = 4;
+  static constexpr unsigned kHashBits = 14;
+  static constexpr std::size_t kMaxOffset = 65535;
+
+  CodecId id() const override {
+    return CodecId::kLz;
+  }
+
+  void compress(const char *src, std::size_t size, std::string &out) const override {
+    std::vector<std::uint32_t> table(std::size_t{1} << kHashBits, kNoPosition);
+    std::size_t anchor = 0;
+    std::size_t i = 0;
+    while (i + kMinMatch <= size) {
+      const std::uint32_t word = load32(src + i);
+      const std::uint32_t h = hash(word);
+      const std::uint32_t candidate = table[h];
+      table[h] = static_cast<std::uint32_t>(i);
+      if (candidate == kNoPosition || i - candidate > kMaxOffset ||
+          load32(src + candidate) != word) {
+        i++;
+        continue;
+      }
+      std::size_t len = kMinMatch;
+      while (i + len < size && src[candidate + len] == src[i + len])
+        len++;
+      put_sequence(out, src + anchor, i - anchor, i - candidate, len);
+      i += len;
+      anchor = i;
+    }
+    put_literals(out, src + anchor, size - anchor, 0);
+  }
+
+  void decompress(const char *src, std::size_t size, char *dst,
+                  std::size_t dst_size) const override {
+    const auto *ip = reinterpret_cast<const unsigned char *>(src);
+    const auto *const iend = ip + size;
+    char *op = dst;
+    char *const oend = dst + dst_size;
+    for (;;) {
+      check(ip < iend);
+      const unsigned token = *ip++;
+      const std::size_t num_literals = get_length(ip, iend, token >> 4);
+      check(num_literals <= static_cast<std::size_t>(iend - ip) &&
+            num_literals <= static_cast<std::size_t>(oend - op));
+      std::memcpy(op, ip, num_literals);
+      ip += num_literals;
+      op += num_literals;
+      if (ip == iend)
+        break;
+      check(iend - ip >= 2);
+      const std::size_t offset = ip[0] | std::size_t{ip[1]} << 8;
+      ip += 2;
+      const std::size_t len = get_length(ip, iend, token & 15) + kMinMatch;
+      check(offset && offset <= static_cast<std::size_t>(op - dst) &&
+            len <= static_cast<std::size_t>(oend - op));
+      // Byte by byte: the match may overlap the bytes it produces.
+      const char *match = op - offset;
+      for (std::size_t k = 0; k < len; k++)
+        op[k] = match[k];
+      op += len;
+    }
+    check(op == oend);
+  }
+
+ private:
+  static constexpr std::uint32_t kNoPosition = ~std::uint32_t{0};
+
+  static std::uint32_t load32(const char *p) {
+    std::uint32_t word;
+    std::memcpy(&word, p, sizeof(word));
+    return word;
+  }
+
+  static std::uint32_t hash(std::uint32_t word) {
+    return word * 2654435761u >> (32 - kHashBits);
+  }
+
+  static void check(bool ok) {
+    if (!ok)
+      throw std::runtime_error("serde: corrupt compressed block");
+  }
+
+  static void put_length(std::string &out, std::size_t extra) {
+    for (; extra >= 255; extra -= 255)
+      out.push_back(static_cast<char>(255));
+    out.push_back(static_cast<char>(extra));
+  }
+
+  static std::size_t get_length(const unsigned char *&ip, const unsigned char *iend,
+                                std::size_t nibble) {
+    std::size_t len = nibble;
+    if (nibble == 15) {
+      unsigned char byte;
+      do {
+        check(ip < iend);
+        byte = *ip++;
+        len += byte;
+      } while (byte == 255);
+    }
+    return len;
+  }
+
+  /// Writes the token, the literals, and leaves the match to the caller.
+  static void put_literals(std::string &out, const char *literals, std::size_t n,
+                           unsigned match_nibble) {
+    out.push_back(static_cast<char>((n < 15 ? n : 15) << 4 | match_nibble));
+    if (n >= 15)
+      put_length(out, n - 15);
+    out.append(literals, n);
+  }
+
+  static void put_sequence(std::string &out, const char *literals, std::size_t n,
+                           std::size_t offset, std::size_t len) {
+    const std::size_t extra = len - kMinMatch;
+    put_literals(out, literals, n, static_cast<unsigned>(extra < 15 ? extra : 15));
+    out.push_back(static_cast<char>(offset & 0xff));
+    out.push_back(static_cast<char>(offset >> 8));
+    if (extra >= 15)
+      put_length(out, extra - 15);
+  }
+};
+
+/// The built-in codec with the given ID; throws for unknown IDs. New codecs get a new `CodecId`
+/// and a case here so that readers can find them.
+inline const Codec &codec_for(CodecId id) {
+  static const NoneCodec none;
+  static const LzCodec lz;
+  switch (id) {
+    case CodecId::kNone:
+      return none;
+    case CodecId::kLz:
+      return lz;
+  }
+  throw std::runtime_error("serde: unknown codec");
+}
+}  // namespace serde
+
+#endif  // SERDE_CODEC__H
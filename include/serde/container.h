@@ -0,0 +1,512 @@
+#ifndef SERDE_CONTAINER__H
+#define SERDE_CONTAINER__H
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "serde/codec.h"
+#include "serde/io.h"
+#include "utility/mapped_file.h"
+
+namespace serde {
+/// Identifies a snapshot file; the bytes read "AST1" on a little-endian host. Read back with its
+/// bytes swapped, it tells a file written on a host of the other byte order.
+inline constexpr std::uint32_t kMagic = 0x31545341;
+inline constexpr std::uint32_t kSwappedMagic = 0x41535431;
+inline constexpr std::uint32_t kContainerVersion = 2;
+/// Sections start on page boundaries so that each can be mapped on its own.
+inline constexpr std::size_t kSectionAlignment = 4096;
+/// Section IDs are class IDs, apart from this one for the strings that the other sections refer
+/// to by number.
+inline constexpr int kStringTableSection = -1;
+/// Section ID of the `SnapshotInfo`.
+inline constexpr int kInfoSection = -2;
+/// Section IDs of the node indices, which give the encoded size of every live node of a class, as
+/// a varint whatever the format, so that one can be found without decoding the ones before it.
+/// Classes whose nodes all take the same room in `io::Format::kFixed` have none in that format.
+inline constexpr int node_index_section(int class_id) {
+  return -class_id;
+}
+/// The snapshot file used when a saver or loader is given a directory.
+inline constexpr const char *kSnapshotFileName = "ast.snapshot";
+
+enum class LoadMode {
+  /// Reads the file through `std::ifstream`.
+  kStream,
+  /// Maps the file and decodes straight from the mapped bytes. `std::string_view` fields borrow
+  /// from the mapping, which the context then keeps until it is cleared.
+  kMapped,
+  /// Like `kMapped`, but only declarations and types are decoded up front. Expressions and
+  /// statements stay in the file until the body of a function that holds them is first asked for
+  /// with `FuncDecl::get_body`, or until `ASTContext::load_lazy_nodes` loads them all. Their pools
+  /// meanwhile have the slots but not the nodes, and `Decl::users` lists only the users decoded so
+  /// far.
+  kLazy,
+};
+
+/// Where the nodes of one class are in a snapshot file.
+struct SectionEntry {
+  std::int32_t class_id;
+  std::uint64_t offset;
+  /// Bytes in the file.
+  std::uint64_t length;
+  /// Bytes once decompressed.
+  std::uint64_t raw_length;
+};
+
+/// A section encoded, and compressed if the writer has a codec, but not yet written.
+struct EncodedSection {
+  std::string bytes;
+  /// Bytes once decompressed.
+  std::uint64_t raw_length{0};
+};
+
+/// `path` itself, or the snapshot file inside it if it is a directory.
+inline std::filesystem::path snapshot_path(const std::filesystem::path &path) {
+  return std::filesystem::is_directory(path) ? path / kSnapshotFileName : path;
+}
+
+/// Where delta `n`, counting from 1, of the snapshot file `snapshot` goes.
+inline std::filesystem::path delta_path(const std::filesystem::path &snapshot, std::uint32_t n) {
+  return snapshot.string() + ".delta." + std::to_string(n);
+}
+
+/// Which save a snapshot file comes from. A full snapshot gets a new `base_id`; its deltas carry
+/// the same one and their number, so that deltas left over from an older snapshot are ignored.
+struct SnapshotInfo {
+  std::uint64_t base_id;
+  /// 0 for the full snapshot.
+  std::uint32_t delta;
+
+  friend bool operator==(const SnapshotInfo &lhs, const SnapshotInfo &rhs) {
+    return lhs.base_id == rhs.base_id && lhs.delta == rhs.delta;
+  }
+  friend bool operator!=(const SnapshotInfo &lhs, const SnapshotInfo &rhs) {
+    return !(lhs == rhs);
+  }
+};
+
+namespace detail {
+/// Magic, version, format, codec, section count.
+inline constexpr std::size_t kContainerHeaderSize = 20;
+/// Class ID and padding, offset, length, raw length.
+inline constexpr std::size_t kSectionEntrySize = 32;
+
+inline void fsync_path(const std::filesystem::path &path) {
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    throw std::system_error{errno, std::generic_category(), path.string()};
+  const int result = ::fsync(fd);
+  const int error = errno;
+  ::close(fd);
+  if (result < 0)
+    throw std::system_error{error, std::generic_category(), path.string()};
+}
+}  // namespace detail
+
+/// Writes a snapshot file: a header, a table of sections, then the sections, each aligned to
+/// `kSectionAlignment`. Everything goes to `<path>.tmp`, which `commit` syncs and renames to
+/// `path`, so readers see either the previous snapshot or the complete new one.
+///
+/// Layout, all integers fixed-width and in the byte order of the host that wrote the file, as are
+/// those in the sections; `SnapshotReader` refuses files from a host of the other byte order:
+///
+///   u32 magic, u32 version, u32 format, u32 codec, u32 number of sections
+///   per section: i32 class ID, 4 bytes of padding, u64 offset, u64 length, u64 raw length
+///   the sections, encoded in `format`
+///
+/// With a codec other than `CodecId::kNone`, a section is a series of blocks, each a u32 raw
+/// size, a u32 stored size, then the bytes, compressed unless both sizes are equal.
+class SnapshotWriter {
+ public:
+  SnapshotWriter(const std::filesystem::path &path, io::Format format, std::size_t num_sections,
+                 CodecId codec = CodecId::kNone)
+      : _path{path},
+        _tmp_path{path.string() + ".tmp"},
+        _format{format},
+        _codec{codec_for(codec)},
+        _file{_tmp_path, std::ios::binary | std::ios::trunc},
+        _out{_file} {
+    if (!_file)
+      throw std::system_error{errno, std::generic_category(), _tmp_path.string()};
+    _sections.reserve(num_sections);
+    _table_end = detail::kContainerHeaderSize + num_sections * detail::kSectionEntrySize;
+    pad_to(_table_end);
+  }
+  SnapshotWriter(const SnapshotWriter &) = delete;
+  SnapshotWriter &operator=(const SnapshotWriter &) = delete;
+  ~SnapshotWriter() {
+    if (!_committed) {
+      _file.close();
+      std::error_code ec;
+      std::filesystem::remove(_tmp_path, ec);
+    }
+  }
+
+ public:
+  /// Encodes a section with `encode(io::BufferedWriter &)` into memory, for `append_section` to
+  /// write later. Touches nothing in the writer, so several threads can encode at once. When known,
+  /// `raw_length` is how much `encode` writes, so that the buffer is allocated once.
+  template <typename F>
+  EncodedSection encode_section(F &&encode, std::size_t raw_length = 0) const {
+    EncodedSection section;
+    io::BufferedWriter stored{section.bytes};
+    if (_codec.id() == CodecId::kNone) {
+      section.bytes.reserve(raw_length);
+      stored.set_format(_format);
+      encode(stored);
+      stored.flush();
+      section.raw_length = section.bytes.size();
+      return section;
+    }
+    std::string scratch;
+    {
+      io::BufferedWriter blocks{[this, &section, &stored, &scratch](const char *data,
+                                                                     std::size_t size) {
+                                  section.raw_length += size;
+                                  write_blocks(_codec, data, size, stored, scratch);
+                                },
+                                Codec::kMaxBlockSize};
+      blocks.set_format(_format);
+      encode(blocks);
+    }
+    stored.flush();
+    return section;
+  }
+
+  /// Appends a section for `class_id` made by `encode_section`.
+  void append_section(int class_id, const EncodedSection &section) {
+    const std::uint64_t offset = begin_section();
+    _out.write(section.bytes.data(), section.bytes.size());
+    _sections.push_back({class_id, offset, section.bytes.size(), section.raw_length});
+  }
+
+  /// Writes the section table, makes the file durable and moves it to its final path.
+  void commit() {
+    _out.flush();
+    _file.seekp(0);
+    {
+      io::BufferedWriter header{_file};
+      io::write_u32(header, kMagic);
+      io::write_u32(header, kContainerVersion);
+      io::write_u32(header, static_cast<std::uint32_t>(_format));
+      io::write_u32(header, static_cast<std::uint32_t>(_codec.id()));
+      io::write_u32(header, static_cast<std::uint32_t>(_sections.size()));
+      for (const auto &s : _sections) {
+        io::detail::write(header, s.class_id);
+        io::write_u32(header, 0);
+        io::write_u64(header, s.offset);
+        io::write_u64(header, s.length);
+        io::write_u64(header, s.raw_length);
+      }
+    }
+    _file.close();
+    if (!_file)
+      throw std::system_error{EIO, std::generic_category(), _tmp_path.string()};
+    detail::fsync_path(_tmp_path);
+    std::filesystem::rename(_tmp_path, _path);
+    detail::fsync_path(_path.has_parent_path() ? _path.parent_path() : ".");
+    _committed = true;
+  }
+
+ private:
+  /// Checks there is room in the table and aligns the next section; returns its offset.
+  std::uint64_t begin_section() {
+    if (detail::kContainerHeaderSize + (_sections.size() + 1) * detail::kSectionEntrySize >
+        _table_end)
+      throw std::logic_error("serde: more sections than announced");
+    pad_to((_out.position() + kSectionAlignment - 1) / kSectionAlignment * kSectionAlignment);
+    return _out.position();
+  }
+
+  static void write_blocks(const Codec &codec, const char *data, std::size_t size,
+                           io::BufferedWriter &out, std::string &scratch) {
+    for (std::size_t done = 0; done < size;) {
+      const std::size_t n = std::min(size - done, Codec::kMaxBlockSize);
+      scratch.clear();
+      codec.compress(data + done, n, scratch);
+      // Incompressible blocks are stored as they are.
+      const bool raw = scratch.size() >= n;
+      io::write_u32(out, static_cast<std::uint32_t>(n));
+      io::write_u32(out, static_cast<std::uint32_t>(raw ? n : scratch.size()));
+      out.write(raw ? data + done : scratch.data(), raw ? n : scratch.size());
+      done += n;
+    }
+  }
+
+  void pad_to(std::size_t offset) {
+    static constexpr char kZeros[64] = {};
+    while (_out.position() < offset)
+      _out.write(kZeros, std::min(sizeof(kZeros), offset - _out.position()));
+  }
+
+ private:
+  std::filesystem::path _path;
+  std::filesystem::path _tmp_path;
+  io::Format _format;
+  const Codec &_codec;
+  std::ofstream _file;
+  io::BufferedWriter _out;
+  std::vector<SectionEntry> _sections;
+  std::size_t _table_end;
+  bool _committed{false};
+};
+
+/// Hands sections made by `SnapshotWriter::encode_section` over to a thread of its own, which
+/// appends them as they come, in any order, then commits. Encoding thus overlaps with writing, and
+/// each buffer is freed as soon as it is on its way to the disk.
+///
+/// Without `finish`, e.g. when encoding throws, nothing is committed and the temporary file goes.
+class BackgroundWriter {
+ public:
+  /// `after_commit` runs on the writing thread once the file is in place.
+  explicit BackgroundWriter(std::unique_ptr<SnapshotWriter> writer,
+                            std::function<void()> after_commit = {})
+      : _writer{writer.get()}, _queue{std::make_shared<Queue>()} {
+    _done = std::async(std::launch::async, [queue = _queue, writer = std::move(writer),
+                                            after_commit = std::move(after_commit)] {
+      for (;;) {
+        std::pair<int, EncodedSection> next;
+        {
+          std::unique_lock lock{queue->mutex};
+          queue->cv.wait(lock, [&queue] {
+            return queue->abandoned || queue->finished || !queue->sections.empty();
+          });
+          if (queue->abandoned)
+            return;
+          if (queue->sections.empty())
+            break;
+          next = std::move(queue->sections.front());
+          queue->sections.pop_front();
+        }
+        writer->append_section(next.first, next.second);
+      }
+      writer->commit();
+      if (after_commit)
+        after_commit();
+    });
+  }
+  BackgroundWriter(const BackgroundWriter &) = delete;
+  BackgroundWriter &operator=(const BackgroundWriter &) = delete;
+  ~BackgroundWriter() {
+    if (!_done.valid())
+      return;
+    {
+      std::lock_guard lock{_queue->mutex};
+      _queue->abandoned = true;
+    }
+    _queue->cv.notify_one();
+    _done.wait();
+  }
+
+ public:
+  /// See `SnapshotWriter::encode_section`; thread-safe.
+  template <typename F>
+  EncodedSection encode_section(F &&encode, std::size_t raw_length = 0) const {
+    return _writer->encode_section(std::forward<F>(encode), raw_length);
+  }
+
+  /// Queues a section for `class_id`; thread-safe.
+  void push(int class_id, EncodedSection section) {
+    {
+      std::lock_guard lock{_queue->mutex};
+      _queue->sections.emplace_back(class_id, std::move(section));
+    }
+    _queue->cv.notify_one();
+  }
+
+  /// Commits once every queued section is written. The future rethrows what the writing thread
+  /// threw; destroying it waits for that thread.
+  std::future<void> finish() {
+    {
+      std::lock_guard lock{_queue->mutex};
+      _queue->finished = true;
+    }
+    _queue->cv.notify_one();
+    return std::move(_done);
+  }
+
+ private:
+  struct Queue {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::pair<int, EncodedSection>> sections;
+    bool finished{false};
+    bool abandoned{false};
+  };
+
+  /// Owned by the writing thread; only its `const` members are used here.
+  const SnapshotWriter *_writer;
+  std::shared_ptr<Queue> _queue;
+  std::future<void> _done;
+};
+
+/// Reads the header and section table of a snapshot file; each section can then be decoded on
+/// its own, in any order.
+class SnapshotReader {
+ public:
+  SnapshotReader(const std::filesystem::path &path, LoadMode mode) : _path{path}, _mode{mode} {
+    if (_mode != LoadMode::kStream) {
+      // Lazy loads decode function bodies at scattered offsets, when they are first asked for.
+      _mapping = std::make_shared<utility::MappedFile>(
+          path, _mode == LoadMode::kLazy ? utility::MappedFile::Access::kRandom
+                                         : utility::MappedFile::Access::kSequential);
+      read_table(io::BufferedReader{_mapping->data(), _mapping->size()});
+    } else {
+      std::ifstream file{path, std::ios::binary};
+      if (!file)
+        throw std::system_error{errno, std::generic_category(), path.string()};
+      read_table(io::BufferedReader{file});
+    }
+  }
+
+ public:
+  io::Format format() const {
+    return _format;
+  }
+  CodecId codec() const {
+    return _codec->id();
+  }
+
+  const std::vector<SectionEntry> &sections() const {
+    return _sections;
+  }
+
+  std::optional<SectionEntry> find(int class_id) const {
+    for (const auto &s : _sections) {
+      if (s.class_id == class_id)
+        return s;
+    }
+    return std::nullopt;
+  }
+
+  /// Unless in `LoadMode::kStream`, the mapping of the whole file, which borrowed strings point
+  /// into.
+  const std::shared_ptr<utility::MappedFile> &mapping() const {
+    return _mapping;
+  }
+
+  /// Calls `decode(io::BufferedReader &)` on the section, read as the mode says and in the
+  /// snapshot's format. Safe to call for different sections from several threads.
+  template <typename F>
+  void read_section(const SectionEntry &section, F &&decode) const {
+    if (_mapping) {
+      io::BufferedReader in{_mapping->data() + section.offset, section.length};
+      decode_section(in, decode);
+    } else {
+      std::ifstream file{_path, std::ios::binary};
+      file.seekg(section.offset);
+      io::BufferedReader in{file, io::kDefaultBufferSize, section.length};
+      decode_section(in, decode);
+    }
+  }
+
+ private:
+  /// Decompresses the blocks of `stored` one at a time as `decode` consumes them.
+  template <typename F>
+  void decode_section(io::BufferedReader &stored, F &decode) const {
+    if (_codec->id() == CodecId::kNone) {
+      stored.set_format(_format);
+      decode(stored);
+      return;
+    }
+    std::unique_ptr<char[]> block{new char[Codec::kMaxBlockSize]};
+    std::string scratch;
+    io::BufferedReader in{[this, &stored, &scratch, buf = block.get()]() -> std::string_view {
+      if (stored.at_end())
+        return {};
+      const std::size_t n = io::read_u32(stored);
+      const std::size_t size = io::read_u32(stored);
+      if (!n || n > Codec::kMaxBlockSize || size > n)
+        throw std::runtime_error("serde: corrupt block header");
+      const char *src = stored.borrow(size);
+      if (!src) {
+        scratch.resize(size);
+        stored.read(scratch.data(), size);
+        src = scratch.data();
+      }
+      if (size == n)
+        return {src, n};
+      _codec->decompress(src, size, buf, n);
+      return {buf, n};
+    }};
+    in.set_format(_format);
+    decode(in);
+  }
+
+  void read_table(io::BufferedReader &&in) {
+    const std::uint32_t magic = io::read_u32(in);
+    if (magic == kSwappedMagic)
+      throw std::runtime_error("serde: snapshot written on a host of the other byte order");
+    if (magic != kMagic)
+      throw std::runtime_error("serde: not a snapshot file");
+    if (io::read_u32(in) != kContainerVersion)
+      throw std::runtime_error("serde: unsupported snapshot version");
+    const auto format = static_cast<io::Format>(io::read_u32(in));
+    if (format != io::Format::kFixed && format != io::Format::kCompact)
+      throw std::runtime_error("serde: unknown snapshot format");
+    _format = format;
+    _codec = &codec_for(static_cast<CodecId>(io::read_u32(in)));
+    _sections.resize(io::read_u32(in));
+    const std::uint64_t file_size =
+        _mapping ? _mapping->size() : std::filesystem::file_size(_path);
+    for (auto &s : _sections) {
+      s.class_id = io::detail::read<std::int32_t>(in);
+      io::read_u32(in);
+      s.offset = io::read_u64(in);
+      s.length = io::read_u64(in);
+      s.raw_length = io::read_u64(in);
+      if (s.offset > file_size || s.length > file_size - s.offset)
+        throw std::runtime_error("serde: section out of bounds");
+    }
+  }
+
+ private:
+  std::filesystem::path _path;
+  LoadMode _mode;
+  io::Format _format{io::Format::kFixed};
+  const Codec *_codec{nullptr};
+  std::shared_ptr<utility::MappedFile> _mapping;
+  std::vector<SectionEntry> _sections;
+};
+
+inline void write_info(BackgroundWriter &writer, const SnapshotInfo &info) {
+  writer.push(kInfoSection, writer.encode_section([&info](io::BufferedWriter &out) {
+    io::write_u64(out, info.base_id);
+    io::write_u32(out, info.delta);
+  }));
+}
+
+/// The info of a snapshot file; nullopt for files written before there were deltas.
+inline std::optional<SnapshotInfo> read_info(const SnapshotReader &reader) {
+  const auto section = reader.find(kInfoSection);
+  if (!section)
+    return std::nullopt;
+  SnapshotInfo info;
+  reader.read_section(*section, [&info](io::BufferedReader &in) {
+    info.base_id = io::read_u64(in);
+    info.delta = io::read_u32(in);
+  });
+  return info;
+}
+}  // namespace serde
+
+#endif  // SERDE_CONTAINER__H
@@ -2,47 +2,83 @@
 #define SERDE_DECODER__H
 
 #include <cstdint>
+#include <deque>
 #include <istream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
 #include <type_traits>
-#include <unordered_map>
 #include <vector>
 
 #include "ast/api/pretty_print.h"
 #include "ast/decl.h"
+#include "ast/node_ref.h"
 #include "ast/type.h"
 #include "reflect/access.h"
 #include "serde/io.h"
 #include "utility/logging.h"
 #include "utility/save_restore.h"
 
-extern std::unordered_map<std::uintptr_t, std::vector<std::pair<void *, void **>>>
-    rfe_old_addr_to_rfr;
+namespace serde::detail {
+/// Decoding state of one section for an `ASTLoader`, installed in `load_state` for the thread that
+/// decodes it.
+struct LoadState {
+  /// A pointer field to set once every pool is loaded.
+  struct Relocation {
+    void **slot;
+    /// The node holding the field.
+    void *user;
+    /// Position in `ast::Nodes` of the target's class.
+    std::uint32_t ordinal;
+    std::uint32_t index;
+  };
+
+  std::vector<Relocation> relocations;
+  /// The node being decoded.
+  void *curr_ast_node{nullptr};
+  /// Characters of `std::string_view` fields that could not be borrowed from the input.
+  std::deque<std::string> owned_strings;
+  /// Whether a `std::string_view` field borrowed from the input or `strings` since this was last
+  /// reset.
+  bool borrowed{false};
+  /// When set, strings are read as IDs in this table instead of in full.
+  const std::vector<std::string_view> *strings{nullptr};
+
+  std::string_view string(std::uint32_t id) const {
+    if (id >= strings->size())
+      throw std::runtime_error("serde: unknown string ID");
+    return (*strings)[id];
+  }
+};
 
-static void *curr_ast_node{nullptr};
+inline thread_local LoadState *load_state{nullptr};
 
-namespace serde::detail {
 template <typename T, typename = void>
 struct DataDecoder {
-  void operator()(std::istream &in_stream, T &object) = delete;
+  template <typename In>
+  void operator()(In &in_stream, T &object) = delete;
 };
 
 template <typename T>
 struct DataDecoder<const T> {
-  void operator()(std::istream &in_stream, T &object) {
+  template <typename In>
+  void operator()(In &in_stream, T &object) {
     DataDecoder<T>{}(in_stream, object);
   }
 };
 
 template <typename T>
 struct DataDecoder<T, std::enable_if_t<std::is_fundamental_v<T> && !std::is_const_v<T>>> {
-  void operator()(std::istream &in_stream, T &object) {
+  template <typename In>
+  void operator()(In &in_stream, T &object) {
     object = io::detail::read<T>(in_stream);
   }
 };
 
 template <typename T>
 struct DataDecoder<T, std::enable_if_t<std::is_enum_v<T>>> {
-  void operator()(std::istream &in_stream, T &object) {
+  template <typename In>
+  void operator()(In &in_stream, T &object) {
     using underlying_type = std::underlying_type_t<T>;
     DataDecoder<underlying_type>{}(in_stream, reinterpret_cast<underlying_type &>(object));
   }
@@ -50,9 +86,10 @@ struct DataDecoder<T, std::enable_if_t<std::is_enum_v<T>>> {
 
 template <typename T>
 struct DataDecoder<T, std::enable_if_t<reflect::is_ast_node_v<T>>> {
-  void operator()(std::istream &in_stream, T &object) {
+  template <typename In>
+  void operator()(In &in_stream, T &object) {
     using Access = reflect::Access<T>;
-    SAVE_RESTORE(curr_ast_node, static_cast<void *>(&object));
+    SAVE_RESTORE(load_state->curr_ast_node, static_cast<void *>(&object));
     if constexpr (Access::kHasSuper)
       load_as<typename Access::super_type>(in_stream, object);
     // DEBUG("{} {} fields to load", __PRETTY_FUNCTION__, Access::kNumFields);
@@ -61,19 +98,19 @@ struct DataDecoder<T, std::enable_if_t<reflect::is_ast_node_v<T>>> {
   }
 
  private:
-  template <typename U>
-  void load_as(std::istream &in_stream, U &object) {
+  template <typename U, typename In>
+  void load_as(In &in_stream, U &object) {
     DataDecoder<U>{}(in_stream, object);
   }
 
-  template <std::size_t... Is>
-  void load_fields(std::istream &in_stream, T &object, std::index_sequence<Is...>) {
+  template <typename In, std::size_t... Is>
+  void load_fields(In &in_stream, T &object, std::index_sequence<Is...>) {
     using Access = reflect::Access<T>;
     (load_field<Is>(in_stream, object), ...);
   }
 
-  template <std::size_t I>
-  void load_field(std::istream &in_stream, T &object) {
+  template <std::size_t I, typename In>
+  void load_field(In &in_stream, T &object) {
     using Access = reflect::Access<T>;
     using Field = typename Access::template FieldAt<I>;
     // DEBUG("Loading {}-th field {}", I + 1, T::kFieldNames[I]);
@@ -89,23 +126,39 @@ struct DataDecoder<T, std::enable_if_t<reflect::is_ast_node_v<T>>> {
 
 template <typename T>
 struct DataDecoder<T *> {
-  void operator()(std::istream &in_stream, T *&ptr) {
-    auto old_addr = io::read_ptr<T>(in_stream);
+  template <typename In>
+  void operator()(In &in_stream, T *&ptr) {
     ptr = nullptr;
     if constexpr (reflect::is_ast_node_v<T>) {
-      rfe_old_addr_to_rfr[reinterpret_cast<std::uintptr_t>(old_addr)].emplace_back(
-          curr_ast_node, reinterpret_cast<void **>(&ptr));
+      const std::uint32_t tag = io::read_u32(in_stream);
+      if (!tag)
+        return;
+      const std::uint32_t index = io::read_u32(in_stream);
+      load_state->relocations.push_back(
+          {reinterpret_cast<void **>(&ptr), load_state->curr_ast_node, tag - 1, index});
+    } else {
+      io::read_ptr<T>(in_stream);
     }
   }
 };
 
+/// Node references are position-independent, so unlike pointers they need no back-patching.
+template <typename T>
+struct DataDecoder<ast::NodeRef<T>> {
+  template <typename In>
+  void operator()(In &in_stream, ast::NodeRef<T> &ref) {
+    ref = ast::NodeRef<T>::from_raw(io::read_u32(in_stream));
+  }
+};
+
 template <typename T>
 struct DataDecoder<std::vector<T>> {
   using value_type = std::vector<T>;
 
-  void operator()(std::istream &in_stream, value_type &xs) {
+  template <typename In>
+  void operator()(In &in_stream, value_type &xs) {
     const std::size_t size = io::read_size(in_stream);
-    value_type(size).swap(xs);
+    xs.resize(size);
     for (std::size_t i = 0; i < size; i++) {
       DataDecoder<T>{}(in_stream, xs[i]);
     }
@@ -117,8 +170,38 @@ struct DataDecoder<std::vector<T>> {
 
 template <>
 struct DataDecoder<std::string> {
-  void operator()(std::istream &in_stream, std::string &s) {
-    s = io::read_str(in_stream);
+  template <typename In>
+  void operator()(In &in_stream, std::string &s) {
+    if (load_state && load_state->strings)
+      s = load_state->string(io::read_u32(in_stream));
+    else
+      io::read_str(in_stream, s);
+  }
+};
+
+/// Views point into `LoadState::strings` when there is one. Otherwise they borrow their characters
+/// from the input when it allows it (see `io::BufferedReader::borrow`), which must then outlive
+/// the node, or they are copied into `LoadState::owned_strings`.
+template <>
+struct DataDecoder<std::string_view> {
+  template <typename In>
+  void operator()(In &in_stream, std::string_view &s) {
+    if (load_state->strings) {
+      s = load_state->string(io::read_u32(in_stream));
+      load_state->borrowed = true;
+      return;
+    }
+    const std::size_t len = io::read_size(in_stream);
+    if constexpr (std::is_same_v<In, io::BufferedReader>) {
+      if (const char *data = in_stream.borrow(len)) {
+        s = {data, len};
+        load_state->borrowed = true;
+        return;
+      }
+    }
+    auto &owned = load_state->owned_strings.emplace_back(len, '\0');
+    io::detail::read_bytes(in_stream, owned.data(), len);
+    s = owned;
   }
 };
 
@@ -126,15 +209,27 @@ template <typename... Ts>
 struct DataDecoder<std::tuple<Ts...>> {
   using value_type = std::tuple<Ts...>;
 
-  void operator()(std::istream &in_stream, value_type &xs) {
+  template <typename In>
+  void operator()(In &in_stream, value_type &xs) {
     helper(std::make_index_sequence<std::tuple_size_v<value_type>>{}, in_stream, xs);
   }
 
-  template <std::size_t... Is>
-  void helper(std::index_sequence<Is...>, std::istream &in_stream, value_type &xs) {
+  template <typename In, std::size_t... Is>
+  void helper(std::index_sequence<Is...>, In &in_stream, value_type &xs) {
     (DataDecoder<std::tuple_element_t<Is, value_type>>{}(in_stream, std::get<Is>(xs)), ...);
   }
 };
+
+/// Builds a node in raw `storage` straight from the stream.
+///
+/// The node is default-constructed in place first, which only sets `kind` and empty members (the
+/// node constructors do not allocate), and every field is then decoded into it exactly once.
+template <typename T, typename In>
+T *decode_node(In &in_stream, void *storage) {
+  T *object = ::new (storage) T;
+  DataDecoder<T>{}(in_stream, *object);
+  return object;
+}
 }  // namespace serde::detail
 
 #endif  // SERDE_DECODER__H
@@ -2,149 +2,738 @@
 #define SERDE_DESERIALIZE__H
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <cstdint>
 #include <cstdlib>
+#include <deque>
 #include <filesystem>
-#include <fstream>
 #include <functional>
 #include <initializer_list>
 #include <iostream>
 #include <iterator>
+#include <memory>
+#include <numeric>
+#include <optional>
 #include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
 #include <tuple>
 #include <type_traits>
 #include <utility>
 #include <vector>
 
 #include "ast/ast_fwd.h"
+#include "ast/context.h"
 #include "ast/decl.h"
+#include "ast/dispatch.h"
 #include "ast/expr.h"
 #include "ast/stmt.h"
 #include "ast/type.h"
 #include "pool.h"
 #include "reflect/access.h"
+#include "reflect/plain.h"
+#include "serde/container.h"
 #include "serde/decoder.h"
 #include "serde/io.h"
+#include "serde/size.h"
 #include "utility/logging.h"
+#include "utility/radix_sort.h"
+#include "utility/save_restore.h"
+#include "utility/thread_pool.h"
 
-inline std::unordered_map<std::uintptr_t, std::vector<std::pair<void *, void **>>>
-    rfe_old_addr_to_rfr{};
-struct IndexEntry {
-  std::uintptr_t old_addr;
-  void *new_addr;
+namespace serde {
+namespace detail {
+template <std::size_t... Is>
+constexpr std::array<bool, sizeof...(Is)> tracks_users(std::index_sequence<Is...>) {
+  return {(std::is_same_v<std::tuple_element_t<Is, ast::Nodes>, ast::ClassDecl> ||
+           std::is_same_v<std::tuple_element_t<Is, ast::Nodes>, ast::VarDecl> ||
+           std::is_same_v<std::tuple_element_t<Is, ast::Nodes>, ast::FuncDecl>)...};
+}
+
+/// Per class ordinal, whether the nodes pointing to one of that class are its users.
+inline constexpr auto kTracksUsers = tracks_users(std::make_index_sequence<ast::kNumNodeClasses>());
+
+template <std::size_t... Is>
+constexpr std::array<bool, sizeof...(Is)> lazy_classes(std::index_sequence<Is...>) {
+  return {(std::is_base_of_v<ast::Expr, std::tuple_element_t<Is, ast::Nodes>> ||
+           std::is_base_of_v<ast::Stmt, std::tuple_element_t<Is, ast::Nodes>>)...};
+}
+
+/// Per class ordinal, whether `LoadMode::kLazy` leaves the nodes of that class in the file.
+inline constexpr auto kLazyClasses = lazy_classes(std::make_index_sequence<ast::kNumNodeClasses>());
+
+/// The number of slots of a pool section and its dead slots, in increasing order.
+struct SlotLayout {
+  std::size_t num_slots;
+  std::vector<std::uint32_t> dead;
 };
-inline std::unordered_map</* Class ID */ int, std::vector<IndexEntry>> addr_mapping{};
 
-namespace serde {
-class ASTLoader {
+inline SlotLayout read_slot_layout(io::BufferedReader &in_s) {
+  SlotLayout layout{io::read_size(in_s), {}};
+  layout.dead.resize(io::read_size(in_s));
+  for (std::size_t k = 0; k < layout.dead.size(); k++) {
+    layout.dead[k] = io::read_u32(in_s);
+    if (layout.dead[k] >= layout.num_slots || (k && layout.dead[k] <= layout.dead[k - 1]))
+      throw std::runtime_error("serde: corrupt list of free slots");
+  }
+  return layout;
+}
+
+/// Checks up front that a section of `T` with `layout`, whose nodes start at `header_size`, is as
+/// long as its fixed-size nodes need.
+template <typename T>
+void check_fixed_size(const SlotLayout &layout, std::size_t header_size,
+                      std::uint64_t raw_length) {
+  const std::size_t num_nodes = layout.num_slots - layout.dead.size();
+  if (raw_length != header_size + num_nodes * kSerializedSize<T>)
+    throw std::runtime_error(std::string{"serde: wrong section length for "}.append(T::kClassName));
+}
+
+/// The nodes that `LoadMode::kLazy` left in a snapshot, decoded a function body at a time straight
+/// from the mapping. Kept by the context; not synchronized.
+class LazyPools final : public ast::LazySource {
  public:
-  ASTLoader(const std::filesystem::path &dir) : _dir{dir} {}
+  LazyPools(ast::ASTContext &ctx, const SnapshotReader &reader,
+            std::vector<std::string_view> strings, std::shared_ptr<std::string> string_blob)
+      : _ctx{ctx},
+        _reader{reader},
+        _strings{std::move(strings)},
+        _string_blob{std::move(string_blob)} {
+    _state.strings = &_strings;
+  }
 
-  void load() {
-    // 1. Load AST nodes.
-    INFO("Loading pools");
-    ast::Decl::update_users = false;
-    load_pools(std::make_index_sequence<std::tuple_size_v<ast::Nodes> - 1>());
-
-    // 2. Load old addr info.
-    INFO("Loading address mapping");
-    auto index_stream = std::ifstream{_dir / "index.db", std::ios::binary};
-    index_stream.seekg(0, std::ios::end);
-    const auto file_end = index_stream.tellg();
-    index_stream.seekg(0, std::ios::beg);
-    while (index_stream.tellg() != file_end) {
-      const int cls_id = io::detail::read<int32_t>(index_stream);
-      DEBUG("offset={}", (std::size_t)index_stream.tellg());
-      const std::size_t n_entries = io::read_size(index_stream);
-      DEBUG("{} has {} nodes", cls_id, n_entries);
-      auto &table = addr_mapping[cls_id];
-      table.resize(n_entries);
-      for (std::size_t i = 0; i < n_entries; i++) {
-        table[i].old_addr = io::read_u64(index_stream);
+ public:
+  /// Gives the pool of `T` its slots, with the dead ones on the free list, and constructs
+  /// nothing. Can be called for different classes from several threads.
+  template <typename T>
+  void reserve_pool(io::BufferedReader &in_s) {
+    auto &lazy = _pools[ast::kNodeOrdinal<T>];
+    lazy.layout = read_slot_layout(in_s);
+    lazy.header_size = in_s.position();
+    lazy.loaded.assign(lazy.layout.num_slots, false);
+    auto &pool = _ctx.pool<T>();
+    pool.allocate(lazy.layout.num_slots);
+    for (auto it = lazy.layout.dead.rbegin(); it != lazy.layout.dead.rend(); ++it)
+      pool.release(*it);
+    DEBUG("Reserved pool of {}, {} node(s) left in the file", T::kClassName,
+          lazy.layout.num_slots - lazy.layout.dead.size());
+  }
+
+  ast::BlockExpr *load_block(std::uint32_t index) override {
+    void *block = nullptr;
+    patch({&block, nullptr, static_cast<std::uint32_t>(ast::kNodeOrdinal<ast::BlockExpr>), index});
+    return static_cast<ast::BlockExpr *>(block);
+  }
+
+  void load_all() override {
+    if (_loaded_all)
+      return;
+    _loaded_all = true;
+    SAVE_RESTORE(ast::Decl::update_users, false);
+    SAVE_RESTORE(load_state, &_state);
+    for (std::size_t i = 0; i < ast::kNumNodeClasses; i++) {
+      ast::with_node_class(i, [this](auto tag) {
+        using C = typename decltype(tag)::type;
+        if constexpr (kLazyClasses[ast::kNodeOrdinal<C>]) {
+          const auto &lazy = _pools[ast::kNodeOrdinal<C>];
+          auto next_dead = lazy.layout.dead.begin();
+          for (std::uint32_t k = 0; k < lazy.layout.num_slots; k++) {
+            if (next_dead != lazy.layout.dead.end() && *next_dead == k)
+              ++next_dead;
+            else if (!lazy.loaded[k])
+              materialize<C>(k);
+          }
+        }
+      });
+    }
+    patch_pending();
+  }
+
+  /// Sets the field of `r`, decoding its target first, and then what that refers to, if they are
+  /// still in the file.
+  void patch(const LoadState::Relocation &r) {
+    SAVE_RESTORE(ast::Decl::update_users, false);
+    SAVE_RESTORE(load_state, &_state);
+    _state.relocations.push_back(r);
+    patch_pending();
+  }
+
+ private:
+  struct LazyPool {
+    SlotLayout layout;
+    /// Per slot, whether its node was decoded, even if it was destroyed since.
+    std::vector<bool> loaded;
+    /// Where the first node starts in the section.
+    std::size_t header_size{0};
+    bool prepared{false};
+    /// The section, decompressed if need be, and where each slot's node starts in it, unless the
+    /// nodes all take the same room.
+    std::string raw;
+    std::string_view bytes;
+    std::vector<std::uint64_t> offsets;
+  };
+
+  static constexpr std::uint64_t kNoOffset = ~std::uint64_t{0};
+
+  /// Patches the relocations of `_state`; decoding a node adds its own pointer fields at the end.
+  void patch_pending() {
+    for (std::size_t k = 0; k < _state.relocations.size(); k++)
+      patch_one(_state.relocations[k]);
+    _state.relocations.clear();
+  }
+
+  void patch_one(LoadState::Relocation r) {
+    if (r.ordinal >= ast::kNumNodeClasses)
+      throw std::runtime_error("serde: reference to an unknown class");
+    ast::with_node_class(r.ordinal, [this, &r](auto tag) {
+      using C = typename decltype(tag)::type;
+      auto &pool = _ctx.pool<C>();
+      if constexpr (kLazyClasses[ast::kNodeOrdinal<C>]) {
+        const auto &loaded = _pools[ast::kNodeOrdinal<C>].loaded;
+        if (r.index < loaded.size() && !loaded[r.index])
+          materialize<C>(r.index);
       }
+      if (!pool.is_live(r.index))
+        throw std::runtime_error("serde: reference to a missing node");
+      C *target = &pool.at(r.index);
+      *r.slot = target;
+      if constexpr (kTracksUsers[ast::kNodeOrdinal<C>])
+        target->add_user(r.user);
+    });
+  }
+
+  template <typename T>
+  void materialize(std::uint32_t index) {
+    const LazyPool &lazy = prepare<T>();
+    const std::uint64_t offset = offset_of<T>(lazy, index);
+    _pools[ast::kNodeOrdinal<T>].loaded[index] = true;
+    io::BufferedReader in_s{lazy.bytes.data() + offset, lazy.bytes.size() - offset};
+    in_s.set_format(_reader.format());
+    _ctx.pool<T>().construct_with(
+        index, [&in_s](void *storage) { return decode_node<T>(in_s, storage); });
+  }
+
+  /// Where the node in slot `index` starts in the section: in O(1) when the nodes all take the
+  /// same room and no slot is free, after a binary search of the free ones otherwise.
+  template <typename T>
+  std::uint64_t offset_of(const LazyPool &lazy, std::uint32_t index) const {
+    if (has_fixed_size<T>(_reader.format())) {
+      const auto &dead = lazy.layout.dead;
+      const auto it = std::lower_bound(dead.begin(), dead.end(), index);
+      if (index >= lazy.layout.num_slots || (it != dead.end() && *it == index))
+        throw std::runtime_error("serde: reference to a missing node");
+      return lazy.header_size + (index - (it - dead.begin())) * kSerializedSize<T>;
     }
+    if (index >= lazy.offsets.size() || lazy.offsets[index] == kNoOffset)
+      throw std::runtime_error("serde: reference to a missing node");
+    return lazy.offsets[index];
+  }
 
-#if 0
-    for (const auto &[class_id, table] : addr_mapping) {
-      DEBUG("Class ID: {}", class_id);
-      for (const auto &entry : table) {
-        DEBUG("  old_addr={}", (void *)entry.old_addr);
+  /// Finds the section of `T` and where its nodes are, the first time one is needed.
+  template <typename T>
+  const LazyPool &prepare() {
+    auto &lazy = _pools[ast::kNodeOrdinal<T>];
+    if (lazy.prepared)
+      return lazy;
+    lazy.prepared = true;
+    const auto section = _reader.find(T::kClassID);
+    if (_reader.codec() == CodecId::kNone) {
+      lazy.bytes = {_reader.mapping()->data() + section->offset, section->length};
+    } else {
+      lazy.raw.resize(section->raw_length);
+      _reader.read_section(*section, [&lazy](io::BufferedReader &in_s) {
+        in_s.read(lazy.raw.data(), lazy.raw.size());
+      });
+      lazy.bytes = lazy.raw;
+    }
+    if (has_fixed_size<T>(_reader.format())) {
+      check_fixed_size<T>(lazy.layout, lazy.header_size, lazy.bytes.size());
+      return lazy;
+    }
+
+    const auto index = _reader.find(node_index_section(T::kClassID));
+    if (!index)
+      throw std::runtime_error(std::string{"serde: no node index for "}.append(T::kClassName));
+    lazy.offsets.assign(lazy.layout.num_slots, kNoOffset);
+    _reader.read_section(*index, [&lazy](io::BufferedReader &in_s) {
+      if (io::read_size(in_s) != lazy.layout.num_slots - lazy.layout.dead.size())
+        throw std::runtime_error("serde: node index does not match its section");
+      std::uint64_t offset = lazy.header_size;
+      auto next_dead = lazy.layout.dead.begin();
+      for (std::size_t i = 0; i < lazy.layout.num_slots; i++) {
+        if (next_dead != lazy.layout.dead.end() && *next_dead == i) {
+          ++next_dead;
+          continue;
+        }
+        lazy.offsets[i] = offset;
+        offset += in_s.read_varint();
       }
+      if (offset > lazy.bytes.size())
+        throw std::runtime_error("serde: node index does not match its section");
+    });
+    return lazy;
+  }
+
+ private:
+  ast::ASTContext &_ctx;
+  /// Holds the mapping that `bytes` and borrowed strings point into.
+  SnapshotReader _reader;
+  std::vector<std::string_view> _strings;
+  std::shared_ptr<std::string> _string_blob;
+  LoadState _state;
+  std::array<LazyPool, ast::kNumNodeClasses> _pools;
+  bool _loaded_all{false};
+};
+}  // namespace detail
+
+/// Loads a snapshot written by `ASTSaver` into an `ASTContext`, replacing what it held.
+///
+/// `path` is the snapshot file, or a directory holding `kSnapshotFileName`. All the back-patching
+/// state belongs to the loader, so several loaders can fill different contexts at the same time.
+///
+/// Pools are decoded in parallel on the shared thread pool, one class per task with its own
+/// `detail::LoadState`, and pointers are then patched in parallel too. `load` must thus not be
+/// called from a task running on that pool.
+///
+/// The deltas that `ASTSaver::save_delta` wrote after the snapshot are replayed on top of it, each
+/// slot taking its node from the last file that saved it. `LoadMode::kLazy` then loads everything
+/// like `LoadMode::kMapped`. The loaded context starts with no dirty slots, once any save it was
+/// still writing is done.
+class ASTLoader {
+ public:
+  ASTLoader(ast::ASTContext &ctx, const std::filesystem::path &path,
+            LoadMode mode = LoadMode::kStream)
+      : _ctx{ctx}, _path{path}, _mode{mode} {}
+  ASTLoader(const std::filesystem::path &path, LoadMode mode = LoadMode::kStream)
+      : ASTLoader{ast::ASTContext::global(), path, mode} {}
+
+  void load() {
+    // A background save of this context may still be writing to the directory.
+    _ctx.wait_for_save();
+    const auto path = snapshot_path(_path);
+    SnapshotReader reader{path, _mode};
+    find_deltas(reader, path);
+
+    // 1. Load AST nodes.
+    INFO("Loading pools, {} delta(s)", _deltas.size());
+    _ctx.clear();
+    load_strings(reader, _strings, _string_blob);
+    for (auto &delta : _deltas)
+      load_strings(delta.reader, delta.strings, delta.string_blob);
+    if (_mode == LoadMode::kLazy && _deltas.empty()) {
+      _lazy = std::make_shared<detail::LazyPools>(_ctx, reader, _strings, _string_blob);
+      _ctx.set_lazy_source(_lazy);
+    } else if (_mode == LoadMode::kLazy) {
+      // Loaded in full after all, front to back.
+      reader.mapping()->advise(utility::MappedFile::Access::kSequential);
+    }
+    load_pools(reader);
+    if (_lazy)
+      defer_lazy_references();
+    bool borrowed = false;
+    for (auto &state : _states) {
+      borrowed |= state.borrowed;
+      if (!state.owned_strings.empty())
+        _ctx.retain(std::make_shared<std::deque<std::string>>(std::move(state.owned_strings)));
     }
-#endif
-#if 0
-    for (const auto &[old_addr, ps] : rfe_old_addr_to_rfr) {
-      std::cerr << "old_addr=" << (void *)old_addr << '\n';
-      for (const auto &[user, slot] : ps) {
-        std::cerr << "  user=" << user << ' ' << "slot=" << slot << '\n';
+    if (borrowed) {
+      if (reader.mapping())
+        _ctx.retain(reader.mapping());
+      if (!_string_blob->empty())
+        _ctx.retain(_string_blob);
+      for (const auto &delta : _deltas) {
+        if (delta.reader.mapping())
+          _ctx.retain(delta.reader.mapping());
+        if (!delta.string_blob->empty())
+          _ctx.retain(delta.string_blob);
       }
     }
-#endif
-    // 3. Patch and update users.
+
+    // 2. Patch pointers and update users.
     INFO("Start back-patching");
-    for (const auto &[cls_id, table] : addr_mapping) {
-      for (auto [old_addr, new_addr] : table) {
-        auto it = rfe_old_addr_to_rfr.find(old_addr);
-        if (it == rfe_old_addr_to_rfr.end())
+    back_patch();
+    _ctx.clear_dirty();
+    if (_base)
+      _ctx.set_snapshot_state({{_base->base_id, static_cast<std::uint32_t>(_deltas.size())}});
+  }
+
+ private:
+  /// Collects the deltas of the snapshot `reader` reads from `path`, up to the first missing one
+  /// or one from another snapshot.
+  void find_deltas(const SnapshotReader &reader, const std::filesystem::path &path) {
+    _deltas.clear();
+    _base = read_info(reader);
+    if (!_base)
+      return;
+    const auto mode = _mode == LoadMode::kStream ? LoadMode::kStream : LoadMode::kMapped;
+    for (std::uint32_t n = 1; std::filesystem::exists(delta_path(path, n)); n++) {
+      SnapshotReader delta{delta_path(path, n), mode};
+      if (read_info(delta) != SnapshotInfo{_base->base_id, n})
+        break;
+      _deltas.push_back({std::move(delta), {}, nullptr});
+    }
+  }
+
+  /// Reads the string table of `reader` into `strings`, pointing into the mapping when the
+  /// section can be borrowed from and into one shared blob otherwise.
+  static void load_strings(const SnapshotReader &reader, std::vector<std::string_view> &strings,
+                           std::shared_ptr<std::string> &string_blob) {
+    const auto section = reader.find(kStringTableSection);
+    if (!section)
+      throw std::runtime_error("serde: no string table");
+    string_blob = std::make_shared<std::string>();
+    // The characters take less than the section, so the views into the blob stay valid.
+    string_blob->reserve(section->raw_length);
+    reader.read_section(*section, [&strings, &string_blob](io::BufferedReader &in_s) {
+      strings.resize(io::read_u32(in_s));
+      for (auto &s : strings) {
+        const std::size_t len = io::read_size(in_s);
+        if (const char *data = in_s.borrow(len)) {
+          s = {data, len};
           continue;
-        for (auto [user, slot] : it->second) {
-          *slot = new_addr;
-          add_user(cls_id, new_addr, user);
         }
+        if (len > string_blob->capacity() - string_blob->size())
+          throw std::runtime_error("serde: corrupt string table");
+        const std::size_t offset = string_blob->size();
+        string_blob->resize(offset + len);
+        in_s.read(string_blob->data() + offset, len);
+        s = {string_blob->data() + offset, len};
       }
+    });
+    DEBUG("Loaded {} distinct string(s)", strings.size());
+  }
+
+  /// Decodes the section of each class on a task of its own, largest first.
+  void load_pools(const SnapshotReader &reader) {
+    std::vector<SectionEntry> sections(ast::kNumNodeClasses);
+    for (std::size_t i = 0; i < ast::kNumNodeClasses; i++) {
+      ast::with_node_class(i, [&reader, &sections, i](auto tag) {
+        using T = typename decltype(tag)::type;
+        const auto section = reader.find(T::kClassID);
+        if (!section)
+          throw std::runtime_error(std::string{"serde: no section for "}.append(T::kClassName));
+        sections[i] = *section;
+      });
     }
+    std::vector<std::size_t> order(ast::kNumNodeClasses);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&sections](std::size_t a, std::size_t b) {
+      return sections[a].raw_length > sections[b].raw_length;
+    });
+
+    _states.assign(ast::kNumNodeClasses, {});
+    utility::concurrency::parallel_for(order.size(), 1, [&](std::size_t begin, std::size_t end) {
+      SAVE_RESTORE(ast::Decl::update_users, false);
+      for (std::size_t k = begin; k < end; k++) {
+        auto &state = _states[order[k]];
+        state.strings = &_strings;
+        SAVE_RESTORE(detail::load_state, &state);
+        ast::with_node_class(order[k], [&](auto tag) {
+          using T = typename decltype(tag)::type;
+          const auto &section = sections[order[k]];
+          reader.read_section(section, [this, &section](io::BufferedReader &in_s) {
+            if (!_deltas.empty())
+              replay_pool<T>(in_s);
+            else if (_lazy && detail::kLazyClasses[ast::kNodeOrdinal<T>])
+              _lazy->reserve_pool<T>(in_s);
+            else
+              decode_pool<T>(in_s, section.raw_length);
+          });
+        });
+      }
+    });
   }
 
- private:
-  template <std::size_t... Is>
-  void load_pools(std::index_sequence<Is...>) {
-    (load_pool<std::tuple_element_t<Is, ast::Nodes>>(), ...);
+  /// Fills the pool of `T` from its section, `raw_length` bytes long.
+  template <typename T>
+  void decode_pool(io::BufferedReader &in_s, std::uint64_t raw_length) {
+    auto &pool = _ctx.pool<T>();
+    const auto layout = detail::read_slot_layout(in_s);
+    if (detail::has_fixed_size<T>(in_s.format()))
+      detail::check_fixed_size<T>(layout, in_s.position(), raw_length);
+    const auto &[n_slots, dead] = layout;
+    DEBUG("Begin loading pool of {}, {} node(s)", T::kClassName, n_slots - dead.size());
+    // The pool is empty, so slot indices come back as they were saved.
+    pool.allocate(n_slots);
+    if constexpr (reflect::is_plain_node_v<T>) {
+      if (in_s.format() == io::Format::kFixed) {
+        // The nodes are their fields back to back, see `ASTSaver::save_plain_nodes`.
+        using Plain = reflect::PlainNode<T>;
+        const std::size_t size = (n_slots - dead.size()) * Plain::kSize;
+        std::unique_ptr<char[]> copy;
+        const char *in = size ? in_s.borrow(size) : nullptr;
+        if (!in && size) {
+          copy.reset(new char[size]);
+          in_s.read(copy.get(), size);
+          in = copy.get();
+        }
+        construct_live(pool, dead, [&in](void *storage) {
+          T *object = ::new (storage) T;
+          Plain::load(in, *object);
+          in += Plain::kSize;
+          return object;
+        });
+        return;
+      }
+    }
+    construct_live(pool, dead,
+                   [&in_s](void *storage) { return detail::decode_node<T>(in_s, storage); });
+  }
+
+  /// Constructs the node of every slot of `pool` but the `dead` ones in slot order with
+  /// `make(void *storage)`, then frees the dead ones.
+  template <typename T, typename F>
+  static void construct_live(ast::Pool<T> &pool, const std::vector<std::uint32_t> &dead,
+                             F &&make) {
+    auto next_dead = dead.begin();
+    for (std::size_t i = 0; i < pool.num_slots(); i++) {
+      if (next_dead != dead.end() && *next_dead == i) {
+        ++next_dead;
+        continue;
+      }
+      T *object = pool.construct_with(i, make);
+      DEBUG("Loaded #{}, addr is {}", i, static_cast<void *>(object));
+    }
+    // Lowest slots first, like a pool that never freed anything.
+    for (auto it = dead.rbegin(); it != dead.rend(); ++it)
+      pool.release(*it);
+    DEBUG("End loading pool of {}", T::kClassName);
   }
 
+  /// Decodes the pool of `T` from the snapshot section `in_s` and the section of each delta.
   template <typename T>
-  void load_pool() {
-    auto &pool = ast::Pool<T>::instance();
-    pool.clear();
-    auto p = _dir / T::kClassName;
-    assert(std::filesystem::exists(p));
-    std::ifstream in_s{p, std::ios::binary};
-    const std::size_t n_nodes = io::read_size(in_s);
-    DEBUG("Begin loading pool of {}, {} node(s)", T::kClassName, n_nodes);
-    pool.reserve(n_nodes);
-    // DEBUG("Pool of {} prepared", T::kClassName);
-    auto &table = addr_mapping[T::kClassID];
-    table.resize(n_nodes);
-    // DEBUG("Address mapping of {} prepared", T::kClassName);
-    pool.for_each([&in_s, &table](std::size_t i, T &object) {
-      DEBUG("Loading #{}, addr is {}", i, static_cast<void *>(&object));
-      table[i].new_addr = &object;
-      load_node(in_s, object);
+  void replay_pool(io::BufferedReader &in_s) {
+    std::vector<io::BufferedReader *> deltas;
+    with_delta_sections<T>(deltas, [this, &in_s, &deltas] { replay_pool<T>(in_s, deltas); });
+  }
+
+  /// Opens the section of `T` in each delta after the ones in `in`, then calls `f`.
+  template <typename T, typename F>
+  void with_delta_sections(std::vector<io::BufferedReader *> &in, const F &f) {
+    if (in.size() == _deltas.size()) {
+      f();
+      return;
+    }
+    const auto &reader = _deltas[in.size()].reader;
+    const auto section = reader.find(T::kClassID);
+    if (!section)
+      throw std::runtime_error(std::string{"serde: no delta section for "}.append(T::kClassName));
+    reader.read_section(*section, [this, &in, &f](io::BufferedReader &in_s) {
+      in.push_back(&in_s);
+      with_delta_sections<T>(in, f);
     });
-    DEBUG("End loading pool of {}", T::kClassName);
   }
 
+  /// See `ASTSaver::save_changes` for the layout of the delta sections. Every saved node is
+  /// decoded in file order; the ones a later delta supersedes are dropped right away, along with
+  /// the pointers they asked for.
   template <typename T>
-  static void load_node(std::istream &in_s, T &object) {
-    detail::DataDecoder<T>{}(in_s, object);
-  }
-
-  void add_user(int class_id, void *new_addr, void *user) {
-    switch (class_id) {
-      case ast::ClassDecl::kClassID:
-        [[fallthrough]];
-      case ast::VarDecl::kClassID:
-        [[fallthrough]];
-      case ast::FuncDecl::kClassID:
-        reinterpret_cast<ast::Decl *>(new_addr)->add_user(user);
-        break;
-      default:
-        break;
+  void replay_pool(io::BufferedReader &base, const std::vector<io::BufferedReader *> &deltas) {
+    constexpr std::uint32_t kDead = ~std::uint32_t{0};
+    auto &pool = _ctx.pool<T>();
+    auto &state = *detail::load_state;
+    const auto [base_slots, dead] = detail::read_slot_layout(base);
+    // source[i]: 0 if slot i comes from the snapshot, d if from delta d, kDead if it is free.
+    std::vector<std::uint32_t> source(base_slots, 0);
+    for (auto i : dead)
+      source[i] = kDead;
+    // The live slots each delta saved, in file order.
+    std::vector<std::vector<std::uint32_t>> saved(deltas.size());
+    for (std::size_t d = 0; d < deltas.size(); d++) {
+      auto &in_s = *deltas[d];
+      const std::size_t n_slots = io::read_size(in_s);
+      if (n_slots > source.size())
+        source.resize(n_slots, kDead);
+      const std::size_t n_changed = io::read_size(in_s);
+      for (std::size_t k = 0, prev = 0; k < n_changed; k++) {
+        const std::uint32_t i = io::read_u32(in_s);
+        const bool live = in_s.read_value<std::uint8_t>();
+        if (i >= n_slots || (k && i <= prev))
+          throw std::runtime_error("serde: corrupt list of changed slots");
+        prev = i;
+        source[i] = live ? static_cast<std::uint32_t>(d + 1) : kDead;
+        if (live)
+          saved[d].push_back(i);
+      }
+    }
+    DEBUG("Begin replaying pool of {}, {} slot(s)", T::kClassName, source.size());
+
+    pool.allocate(source.size());
+    auto decode = [this, &pool, &state, &source](io::BufferedReader &in_s, std::size_t i,
+                                                 std::uint32_t from) {
+      state.strings = from ? &_deltas[from - 1].strings : &_strings;
+      if (source[i] == from) {
+        pool.construct_with(
+            i, [&in_s](void *storage) { return detail::decode_node<T>(in_s, storage); });
+        return;
+      }
+      const std::size_t num_relocations = state.relocations.size();
+      alignas(T) unsigned char storage[sizeof(T)];
+      std::destroy_at(detail::decode_node<T>(in_s, storage));
+      state.relocations.erase(state.relocations.begin() + num_relocations,
+                              state.relocations.end());
+    };
+    auto next_dead = dead.begin();
+    for (std::size_t i = 0; i < base_slots; i++) {
+      if (next_dead != dead.end() && *next_dead == i)
+        ++next_dead;
+      else
+        decode(base, i, 0);
+    }
+    for (std::size_t d = 0; d < deltas.size(); d++) {
+      for (auto i : saved[d])
+        decode(*deltas[d], i, static_cast<std::uint32_t>(d + 1));
+    }
+    state.strings = &_strings;
+    for (std::size_t i = source.size(); i-- > 0;) {
+      if (source[i] == kDead)
+        pool.release(i);
     }
+    DEBUG("End replaying pool of {}", T::kClassName);
+  }
+
+  /// In `LoadMode::kLazy`, hands the references to nodes left in the file to `_lazy`: function
+  /// bodies become stubs and anything else is decoded now.
+  void defer_lazy_references() {
+    constexpr auto kFuncDecl = ast::kNodeOrdinal<ast::FuncDecl>;
+    for (std::size_t i = 0; i < ast::kNumNodeClasses; i++) {
+      auto &relocations = _states[i].relocations;
+      auto deferred =
+          std::stable_partition(relocations.begin(), relocations.end(), [](const auto &r) {
+            return r.ordinal >= ast::kNumNodeClasses || !detail::kLazyClasses[r.ordinal];
+          });
+      for (auto it = deferred; it != relocations.end(); ++it) {
+        auto *fn = i == kFuncDecl ? static_cast<ast::FuncDecl *>(it->user) : nullptr;
+        if (fn && it->slot == reinterpret_cast<void **>(&fn->body)) {
+          fn->body = nullptr;
+          fn->lazy_source = _lazy.get();
+          fn->lazy_body_index = it->index;
+        } else {
+          _lazy->patch(*it);
+        }
+      }
+      relocations.erase(deferred, relocations.end());
+    }
+  }
+
+  /// Sets the pointer fields, in parallel over ranges of relocations. The users found on the way
+  /// go into one array, exactly sized and sorted by target, so that the users of each declaration
+  /// are next to each other and each `Decl::users` is filled by a single task, in one go.
+  void back_patch() {
+    using Relocation = detail::LoadState::Relocation;
+    struct Range {
+      const Relocation *begin;
+      const Relocation *end;
+    };
+    std::vector<Range> ranges;
+    for (const auto &state : _states) {
+      const Relocation *data = state.relocations.data();
+      const std::size_t n = state.relocations.size();
+      for (std::size_t begin = 0; begin < n; begin += kRelocationGrain)
+        ranges.push_back({data + begin, data + std::min(n, begin + kRelocationGrain)});
+    }
+
+    // starts[k]: where the users found in `ranges[k]` go.
+    std::vector<std::size_t> starts(ranges.size() + 1);
+    utility::concurrency::parallel_for(ranges.size(), 1, [&](std::size_t begin, std::size_t end) {
+      for (std::size_t k = begin; k < end; k++) {
+        std::size_t n = 0;
+        for (const Relocation *r = ranges[k].begin; r != ranges[k].end; ++r)
+          n += relocate(*r);
+        starts[k + 1] = n;
+      }
+    });
+    std::partial_sum(starts.begin(), starts.end(), starts.begin());
+
+    std::vector<User> users(starts.back());
+    utility::concurrency::parallel_for(ranges.size(), 1, [&](std::size_t begin, std::size_t end) {
+      for (std::size_t k = begin; k < end; k++) {
+        User *out = users.data() + starts[k];
+        for (const Relocation *r = ranges[k].begin; r != ranges[k].end; ++r) {
+          if (detail::kTracksUsers[r->ordinal])
+            *out++ = {std::uint64_t{r->ordinal} << 32 | r->index, r->user};
+        }
+      }
+    });
+    utility::radix_sort(users, [](const User &u) { return u.target; });
+
+    // Ranges of users are widened to whole runs of the same target, so no two tasks share one.
+    utility::concurrency::parallel_for(
+        users.size(), kRelocationGrain, [this, &users](std::size_t begin, std::size_t end) {
+          while (begin && begin < end && users[begin].target == users[begin - 1].target)
+            begin++;
+          while (end < users.size() && users[end].target == users[end - 1].target)
+            end++;
+          for (std::size_t run_end; begin < end; begin = run_end) {
+            run_end = begin + 1;
+            while (run_end < end && users[run_end].target == users[begin].target)
+              run_end++;
+            ast::Decl *target = tracked_target(users[begin].target);
+            target->users.reserve(target->users.size() + (run_end - begin));
+            for (std::size_t k = begin; k < run_end; k++)
+              target->add_user(users[k].user);
+          }
+        });
+  }
+
+  /// Points the field at its target; returns whether the target keeps track of its users.
+  bool relocate(const detail::LoadState::Relocation &r) {
+    if (r.ordinal >= ast::kNumNodeClasses)
+      throw std::runtime_error("serde: reference to an unknown class");
+    ast::with_node_class(r.ordinal, [this, &r](auto tag) {
+      using C = typename decltype(tag)::type;
+      auto &pool = _ctx.pool<C>();
+      if (!pool.is_live(r.index))
+        throw std::runtime_error("serde: reference to a missing node");
+      *r.slot = &pool.at(r.index);
+    });
+    return detail::kTracksUsers[r.ordinal];
   }
 
+  /// The declaration that `User::target` refers to.
+  ast::Decl *tracked_target(std::uint64_t target) {
+    ast::Decl *decl = nullptr;
+    ast::with_node_class(target >> 32, [this, &decl, target](auto tag) {
+      using C = typename decltype(tag)::type;
+      if constexpr (std::is_base_of_v<ast::Decl, C>)
+        decl = &_ctx.pool<C>().at(static_cast<std::uint32_t>(target));
+    });
+    return decl;
+  }
+
+  /// A node to add to the users of a declaration.
+  struct User {
+    /// Ordinal of the declaration's class in the high half, slot index in the low one.
+    std::uint64_t target;
+    void *user;
+  };
+
+  /// A delta to replay on top of the snapshot.
+  struct Delta {
+    SnapshotReader reader;
+    std::vector<std::string_view> strings;
+    std::shared_ptr<std::string> string_blob;
+  };
+
+  /// Relocations patched, or users added, by one task at a time.
+  static constexpr std::size_t kRelocationGrain = std::size_t{1} << 14;
+
  private:
-  std::filesystem::path _dir;
+  ast::ASTContext &_ctx;
+  std::filesystem::path _path;
+  LoadMode _mode;
+
+  /// One per class, indexed by ordinal.
+  std::vector<detail::LoadState> _states;
+  std::vector<std::string_view> _strings;
+  std::shared_ptr<std::string> _string_blob;
+  /// The info of the snapshot, and its deltas in the order to replay them.
+  std::optional<SnapshotInfo> _base;
+  std::vector<Delta> _deltas;
+  /// In `LoadMode::kLazy`, what decodes the nodes left in the file.
+  std::shared_ptr<detail::LazyPools> _lazy;
 };
 }  // namespace serde
 
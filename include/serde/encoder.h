@@ -1,37 +1,83 @@
 #ifndef SERDE_ENCODER__H
 #define SERDE_ENCODER__H
 
+#include <cstdint>
+#include <deque>
 #include <iostream>
+#include <mutex>
 #include <ostream>
+#include <string>
+#include <string_view>
 #include <tuple>
 #include <type_traits>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 // #include "ast/decl.h"
+#include "ast/dispatch.h"
+#include "ast/node_ref.h"
+#include "pool.h"
 #include "reflect/access.h"
 #include "serde/io.h"
 #include "utility/logging.h"
 
 namespace serde::detail {
+/// The distinct strings met while saving, numbered in order of appearance. `intern` may be called
+/// from several threads at once; the numbering then depends on which thread meets a string first.
+class StringTable {
+ public:
+  std::uint32_t intern(std::string_view s) {
+    std::lock_guard lock{_mutex};
+    if (auto it = _ids.find(s); it != _ids.end())
+      return it->second;
+    const auto id = static_cast<std::uint32_t>(_strings.size());
+    _ids.emplace(_strings.emplace_back(s), id);
+    return id;
+  }
+
+  /// Not to be called while other threads intern.
+  const std::deque<std::string> &strings() const {
+    return _strings;
+  }
+
+ private:
+  /// A deque, so that the keys of `_ids` stay valid.
+  std::deque<std::string> _strings;
+  std::unordered_map<std::string_view, std::uint32_t> _ids;
+  std::mutex _mutex;
+};
+
+/// Encoding state of one `ASTSaver`, installed in `save_state` for each thread that encodes.
+struct SaveState {
+  /// When set, strings are written as IDs in this table instead of in full.
+  StringTable *strings{nullptr};
+};
+
+inline thread_local SaveState *save_state{nullptr};
+
 template <typename T, typename = void>
 struct DataEncoder {
-  void operator()(std::ostream &out_stream, const T &object) = delete;
+  template <typename Out>
+  void operator()(Out &out_stream, const T &object) = delete;
 };
 
 template <typename T>
 struct DataEncoder<const T> {
-  void operator()(std::ostream &out_stream, const T &object);
+  template <typename Out>
+  void operator()(Out &out_stream, const T &object);
 };
 
 template <typename T>
 struct DataEncoder<T, std::enable_if_t<std::is_fundamental_v<T> && !std::is_const_v<T>>> {
-  void operator()(std::ostream &out_stream, T object);
+  template <typename Out>
+  void operator()(Out &out_stream, T object);
 };
 
 template <typename T>
 struct DataEncoder<T, std::enable_if_t<std::is_enum_v<T>>> {
-  void operator()(std::ostream &out_stream, T object) {
+  template <typename Out>
+  void operator()(Out &out_stream, T object) {
     using underlying_type = std::underlying_type_t<T>;
     DataEncoder<underlying_type>{}(out_stream, static_cast<underlying_type>(object));
   }
@@ -39,46 +85,63 @@ struct DataEncoder<T, std::enable_if_t<std::is_enum_v<T>>> {
 
 template <typename T>
 struct DataEncoder<T, std::enable_if_t<reflect::is_ast_node_v<T>>> {
-  void operator()(std::ostream &out_stream, const T &object);
+  template <typename Out>
+  void operator()(Out &out_stream, const T &object);
 
  private:
-  template <typename U>
-  void save_as(std::ostream &out_stream, const U &object);
+  template <typename U, typename Out>
+  void save_as(Out &out_stream, const U &object);
 
-  template <std::size_t... Is>
-  void save_fields(std::ostream &out_stream, const T &object, std::index_sequence<Is...>);
+  template <typename Out, std::size_t... Is>
+  void save_fields(Out &out_stream, const T &object, std::index_sequence<Is...>);
 
-  template <std::size_t I>
-  void save_field(std::ostream &out_stream, const T &object);
+  template <std::size_t I, typename Out>
+  void save_field(Out &out_stream, const T &object);
 };
 
 template <typename T>
 struct DataEncoder<T *> {
-  void operator()(std::ostream &out_stream, const T *ptr);
+  template <typename Out>
+  void operator()(Out &out_stream, const T *ptr);
+};
+
+template <typename T>
+struct DataEncoder<ast::NodeRef<T>> {
+  template <typename Out>
+  void operator()(Out &out_stream, ast::NodeRef<T> ref);
 };
 
 template <typename T>
 struct DataEncoder<std::vector<T>> {
   using value_type = std::vector<T>;
 
-  void operator()(std::ostream &out_stream, const value_type &xs);
+  template <typename Out>
+  void operator()(Out &out_stream, const value_type &xs);
 };
 
 template <>
 struct DataEncoder<std::string> {
-  void operator()(std::ostream &out_stream, const std::string &s);
+  template <typename Out>
+  void operator()(Out &out_stream, const std::string &s);
+};
+
+template <>
+struct DataEncoder<std::string_view> {
+  template <typename Out>
+  void operator()(Out &out_stream, std::string_view s);
 };
 
 template <typename... Ts>
 struct DataEncoder<std::tuple<Ts...>> {
   using value_type = std::tuple<Ts...>;
 
-  void operator()(std::ostream &out_stream, const value_type &xs) {
+  template <typename Out>
+  void operator()(Out &out_stream, const value_type &xs) {
     helper(std::make_index_sequence<std::tuple_size_v<value_type>>{}, out_stream, xs);
   }
 
-  template <std::size_t... Is>
-  void helper(std::index_sequence<Is...>, std::ostream &out_stream, const value_type &xs) {
+  template <typename Out, std::size_t... Is>
+  void helper(std::index_sequence<Is...>, Out &out_stream, const value_type &xs) {
     (DataEncoder<std::tuple_element_t<Is, value_type>>{}(out_stream, std::get<Is>(xs)), ...);
   }
 };
@@ -86,19 +149,22 @@ struct DataEncoder<std::tuple<Ts...>> {
 
 namespace serde::detail {
 template <typename T>
-void DataEncoder<const T>::operator()(std::ostream &out_stream, const T &object) {
+template <typename Out>
+void DataEncoder<const T>::operator()(Out &out_stream, const T &object) {
   DataEncoder<T>{}(out_stream, object);
 }
 
 template <typename T>
+template <typename Out>
 void DataEncoder<T, std::enable_if_t<std::is_fundamental_v<T> && !std::is_const_v<T>>>::operator()(
-    std::ostream &out_stream, T object) {
+    Out &out_stream, T object) {
   io::detail::write(out_stream, object);
 }
 
 template <typename T>
+template <typename Out>
 void DataEncoder<T, std::enable_if_t<reflect::is_ast_node_v<T>>>::operator()(
-    std::ostream &out_stream, const T &object) {
+    Out &out_stream, const T &object) {
   using Access = reflect::Access<T>;
   if constexpr (Access::kHasSuper)
     save_as<typename Access::super_type>(out_stream, object);
@@ -106,24 +172,24 @@ void DataEncoder<T, std::enable_if_t<reflect::is_ast_node_v<T>>>::operator()(
 }
 
 template <typename T>
-template <typename U>
-void DataEncoder<T, std::enable_if_t<reflect::is_ast_node_v<T>>>::save_as(std::ostream &out_stream,
+template <typename U, typename Out>
+void DataEncoder<T, std::enable_if_t<reflect::is_ast_node_v<T>>>::save_as(Out &out_stream,
                                                                           const U &object) {
   DataEncoder<U>{}(out_stream, object);
 }
 
 template <typename T>
-template <std::size_t... Is>
+template <typename Out, std::size_t... Is>
 void DataEncoder<T, std::enable_if_t<reflect::is_ast_node_v<T>>>::save_fields(
-    std::ostream &out_stream, const T &object, std::index_sequence<Is...>) {
+    Out &out_stream, const T &object, std::index_sequence<Is...>) {
   using Access = reflect::Access<T>;
   (save_field<Is>(out_stream, object), ...);
 }
 
 template <typename T>
-template <std::size_t I>
+template <std::size_t I, typename Out>
 void DataEncoder<T, std::enable_if_t<reflect::is_ast_node_v<T>>>::save_field(
-    std::ostream &out_stream, const T &object) {
+    Out &out_stream, const T &object) {
   using Access = reflect::Access<T>;
   using Field = typename Access::template FieldAt<I>;
   if constexpr (Field::is_transient) {
@@ -135,21 +201,52 @@ void DataEncoder<T, std::enable_if_t<reflect::is_ast_node_v<T>>>::save_field(
   }
 }
 
+/// A pointer to a node is written as its class (position in `ast::Nodes` plus one, zero for null)
+/// followed by its slot index, both independent of where the pools live.
 template <typename T>
-void DataEncoder<T *>::operator()(std::ostream &out_stream, const T *ptr) {
-  io::write_ptr(out_stream, ptr);
+template <typename Out>
+void DataEncoder<T *>::operator()(Out &out_stream, const T *ptr) {
+  if constexpr (reflect::is_ast_node_v<T>) {
+    if (!ptr) {
+      io::write_u32(out_stream, 0);
+      return;
+    }
+    ast::visit_concrete(ptr, [&out_stream](const auto *node) {
+      using C = std::remove_const_t<std::remove_pointer_t<decltype(node)>>;
+      io::write_u32(out_stream, static_cast<std::uint32_t>(ast::kNodeOrdinal<C> + 1));
+      io::write_u32(out_stream, static_cast<std::uint32_t>(ast::Pool<C>::index_of(node)));
+    });
+  } else {
+    io::write_ptr(out_stream, ptr);
+  }
 }
 
 template <typename T>
-void DataEncoder<std::vector<T>>::operator()(std::ostream &out_stream, const value_type &xs) {
+template <typename Out>
+void DataEncoder<ast::NodeRef<T>>::operator()(Out &out_stream, ast::NodeRef<T> ref) {
+  io::write_u32(out_stream, ref.raw());
+}
+
+template <typename T>
+template <typename Out>
+void DataEncoder<std::vector<T>>::operator()(Out &out_stream, const value_type &xs) {
   io::write_size(out_stream, xs.size());
   for (const auto &x : xs) {
     DataEncoder<T>{}(out_stream, x);
   }
 }
 
-inline void DataEncoder<std::string>::operator()(std::ostream &out_stream, const std::string &s) {
-  io::write_str(out_stream, s);
+template <typename Out>
+inline void DataEncoder<std::string>::operator()(Out &out_stream, const std::string &s) {
+  DataEncoder<std::string_view>{}(out_stream, s);
+}
+
+template <typename Out>
+inline void DataEncoder<std::string_view>::operator()(Out &out_stream, std::string_view s) {
+  if (save_state && save_state->strings)
+    io::write_u32(out_stream, save_state->strings->intern(s));
+  else
+    io::write_str(out_stream, s);
 }
 }  // namespace serde::detail
 
@@ -1,13 +1,269 @@
 #ifndef SERDE_BYTES_IO__H
 #define SERDE_BYTES_IO__H
 
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <stdexcept>
+#include <string>
 #include <string_view>
 #include <type_traits>
 
 namespace serde::io {
+inline constexpr std::size_t kDefaultBufferSize = std::size_t{1} << 16;
+
+/// How integers are laid out by the buffered streams.
+enum class Format : std::uint8_t {
+  /// Every integer at its full width.
+  kFixed,
+  /// Integers wider than a byte as LEB128 varints, signed ones zigzag-encoded first.
+  kCompact,
+};
+
+/// The longest LEB128 encoding of a 64-bit value.
+inline constexpr std::size_t kMaxVarintSize = 10;
+
+inline std::uint64_t zigzag_encode(std::int64_t value) {
+  return static_cast<std::uint64_t>(value) << 1 ^ static_cast<std::uint64_t>(value >> 63);
+}
+
+inline std::int64_t zigzag_decode(std::uint64_t value) {
+  return static_cast<std::int64_t>(value >> 1 ^ (~(value & 1) + 1));
+}
+
+/// Collects small writes in a large buffer and hands it to a sink in one piece when full.
+class BufferedWriter {
+ public:
+  using Sink = std::function<void(const char *data, std::size_t size)>;
+
+  explicit BufferedWriter(Sink sink, std::size_t capacity = kDefaultBufferSize)
+      : _sink{std::move(sink)}, _buf{new char[capacity]}, _capacity{capacity} {}
+  explicit BufferedWriter(std::ostream &out, std::size_t capacity = kDefaultBufferSize)
+      : BufferedWriter{[&out](const char *data, std::size_t size) { out.write(data, size); },
+                       capacity} {}
+  /// Appends to `out`.
+  explicit BufferedWriter(std::string &out, std::size_t capacity = kDefaultBufferSize)
+      : BufferedWriter{[&out](const char *data, std::size_t size) { out.append(data, size); },
+                       capacity} {}
+  BufferedWriter(const BufferedWriter &) = delete;
+  BufferedWriter &operator=(const BufferedWriter &) = delete;
+  ~BufferedWriter() {
+    flush();
+  }
+
+ public:
+  void write(const void *data, std::size_t size) {
+    if (size <= _capacity - _pos) {
+      std::memcpy(_buf.get() + _pos, data, size);
+      _pos += size;
+      return;
+    }
+    write_slow(static_cast<const char *>(data), size);
+  }
+
+  template <typename T>
+  void write_value(T value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    write(&value, sizeof(T));
+  }
+
+  void write_varint(std::uint64_t value) {
+    char bytes[kMaxVarintSize];
+    const bool direct = _capacity - _pos >= kMaxVarintSize;
+    char *p = direct ? _buf.get() + _pos : bytes;
+    char *const begin = p;
+    for (; value >= 0x80; value >>= 7)
+      *p++ = static_cast<char>(value | 0x80);
+    *p++ = static_cast<char>(value);
+    if (direct)
+      _pos += p - begin;
+    else
+      write(bytes, p - bytes);
+  }
+
+  Format format() const {
+    return _format;
+  }
+  void set_format(Format format) {
+    _format = format;
+  }
+
+  /// Hands the buffered bytes to the sink.
+  void flush() {
+    if (_pos) {
+      _sink(_buf.get(), _pos);
+      _flushed += _pos;
+      _pos = 0;
+    }
+  }
+
+  /// Bytes written so far, buffered ones included.
+  std::size_t position() const {
+    return _flushed + _pos;
+  }
+
+ private:
+  void write_slow(const char *data, std::size_t size) {
+    flush();
+    if (size >= _capacity) {
+      _sink(data, size);
+      _flushed += size;
+      return;
+    }
+    std::memcpy(_buf.get(), data, size);
+    _pos = size;
+  }
+
+ private:
+  Sink _sink;
+  std::unique_ptr<char[]> _buf;
+  std::size_t _capacity;
+  std::size_t _pos{0};
+  std::size_t _flushed{0};
+  Format _format{Format::kFixed};
+};
+
+/// Reads from a sequence of memory blocks, asking its source for the next one only when the
+/// current one is used up, so the bounds are checked once per value on the fast path.
+class BufferedReader {
+ public:
+  /// Returns the next block of input, or an empty view at the end.
+  using Source = std::function<std::string_view()>;
+
+  /// `stable_blocks` tells that the blocks stay valid after the next one is requested.
+  explicit BufferedReader(Source source, bool stable_blocks = false)
+      : _source{std::move(source)}, _stable_blocks{stable_blocks} {}
+  /// Reads at most `limit` bytes from `in`.
+  explicit BufferedReader(std::istream &in, std::size_t capacity = kDefaultBufferSize,
+                          std::size_t limit = SIZE_MAX)
+      : _buf{new char[capacity]} {
+    _source = [&in, buf = _buf.get(), capacity, limit]() mutable {
+      in.read(buf, std::min(capacity, limit));
+      const auto n = static_cast<std::size_t>(in.gcount());
+      limit -= n;
+      return std::string_view{buf, n};
+    };
+  }
+  /// Reads `size` bytes at `data` in place.
+  BufferedReader(const char *data, std::size_t size)
+      : _source{[] { return std::string_view{}; }},
+        _stable_blocks{true},
+        _cur{data},
+        _end{data + size} {}
+  BufferedReader(const BufferedReader &) = delete;
+  BufferedReader &operator=(const BufferedReader &) = delete;
+
+ public:
+  void read(void *data, std::size_t size) {
+    if (size <= static_cast<std::size_t>(_end - _cur)) {
+      std::memcpy(data, _cur, size);
+      _cur += size;
+      return;
+    }
+    read_slow(static_cast<char *>(data), size);
+  }
+
+  template <typename T>
+  T read_value() {
+    static_assert(std::is_trivially_copyable_v<T>);
+    T value;
+    read(&value, sizeof(T));
+    return value;
+  }
+
+  std::uint64_t read_varint() {
+    // Most values are small: one byte, one check.
+    if (_cur != _end && static_cast<unsigned char>(*_cur) < 0x80)
+      return static_cast<unsigned char>(*_cur++);
+    if (static_cast<std::size_t>(_end - _cur) >= kMaxVarintSize) {
+      std::uint64_t value = 0;
+      for (unsigned shift = 0; shift < 64; shift += 7) {
+        const auto byte = static_cast<unsigned char>(*_cur++);
+        value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+        if (byte < 0x80)
+          return value;
+      }
+      throw std::runtime_error("serde: malformed varint");
+    }
+    return read_varint_slow();
+  }
+
+  Format format() const {
+    return _format;
+  }
+  void set_format(Format format) {
+    _format = format;
+  }
+
+  /// Skips `size` bytes and returns where they are in the input, without copying; nullptr if the
+  /// blocks are not stable or the bytes straddle two of them.
+  const char *borrow(std::size_t size) {
+    if (!_stable_blocks || size > static_cast<std::size_t>(_end - _cur))
+      return nullptr;
+    const char *data = _cur;
+    _cur += size;
+    return data;
+  }
+
+  bool at_end() {
+    return _cur == _end && !refill();
+  }
+
+  /// Bytes consumed so far.
+  std::size_t position() const {
+    return _consumed + static_cast<std::size_t>(_cur - _begin);
+  }
+
+ private:
+  bool refill() {
+    _consumed += static_cast<std::size_t>(_end - _begin);
+    const auto block = _source();
+    _begin = _cur = block.data();
+    _end = block.data() + block.size();
+    return !block.empty();
+  }
+
+  std::uint64_t read_varint_slow() {
+    std::uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      const auto byte = read_value<unsigned char>();
+      value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+      if (byte < 0x80)
+        return value;
+    }
+    throw std::runtime_error("serde: malformed varint");
+  }
+
+  void read_slow(char *data, std::size_t size) {
+    for (;;) {
+      const auto n = std::min(size, static_cast<std::size_t>(_end - _cur));
+      std::memcpy(data, _cur, n);
+      _cur += n;
+      data += n;
+      size -= n;
+      if (!size)
+        return;
+      if (!refill())
+        throw std::runtime_error("serde: unexpected end of input");
+    }
+  }
+
+ private:
+  Source _source;
+  std::unique_ptr<char[]> _buf;
+  bool _stable_blocks{false};
+  Format _format{Format::kFixed};
+  const char *_cur{nullptr};
+  const char *_end{nullptr};
+  /// Start of the current block.
+  const char *_begin{_cur};
+  /// Bytes of the blocks before the current one.
+  std::size_t _consumed{0};
+};
+
 namespace detail {
 template <typename T, typename = std::enable_if_t<std::is_integral_v<T>>>
 void write(std::ostream &out, T value) {
@@ -19,6 +275,20 @@ void write(std::ostream &out, T value) {
   out.write(u.bytes, sizeof(T));
 }
 
+template <typename T, typename = std::enable_if_t<std::is_integral_v<T>>>
+void write(BufferedWriter &out, T value) {
+  if constexpr (sizeof(T) > 1) {
+    if (out.format() == Format::kCompact) {
+      if constexpr (std::is_signed_v<T>)
+        out.write_varint(zigzag_encode(value));
+      else
+        out.write_varint(value);
+      return;
+    }
+  }
+  out.write_value(value);
+}
+
 template <typename T, typename = std::enable_if_t<std::is_integral_v<T>>>
 T read(std::istream &in) {
   union {
@@ -28,47 +298,83 @@ T read(std::istream &in) {
   in.read(u.bytes, sizeof(T));
   return u.i;
 }
+
+template <typename T, typename = std::enable_if_t<std::is_integral_v<T>>>
+T read(BufferedReader &in) {
+  if constexpr (sizeof(T) > 1) {
+    if (in.format() == Format::kCompact) {
+      if constexpr (std::is_signed_v<T>)
+        return static_cast<T>(zigzag_decode(in.read_varint()));
+      else
+        return static_cast<T>(in.read_varint());
+    }
+  }
+  return in.read_value<T>();
+}
+
+inline void write_bytes(std::ostream &out, const char *data, std::size_t size) {
+  out.write(data, size);
+}
+inline void write_bytes(BufferedWriter &out, const char *data, std::size_t size) {
+  out.write(data, size);
+}
+
+inline void read_bytes(std::istream &in, char *data, std::size_t size) {
+  in.read(data, size);
+}
+inline void read_bytes(BufferedReader &in, char *data, std::size_t size) {
+  in.read(data, size);
+}
 }  // namespace detail
 
-inline void write_u32(std::ostream &out, uint32_t value) {
+template <typename Out>
+inline void write_u32(Out &out, uint32_t value) {
   detail::write(out, value);
 }
-inline void write_u64(std::ostream &out, uint64_t value) {
+template <typename Out>
+inline void write_u64(Out &out, uint64_t value) {
   detail::write(out, value);
 }
-inline void write_size(std::ostream &out, std::size_t value) {
+template <typename Out>
+inline void write_size(Out &out, std::size_t value) {
   detail::write(out, value);
 }
-template <typename T>
-inline void write_ptr(std::ostream &out, T *ptr) {
+template <typename Out, typename T>
+inline void write_ptr(Out &out, T *ptr) {
   detail::write(out, reinterpret_cast<std::uintptr_t>(ptr));
 }
-inline void write_str(std::ostream &out, std::string_view s) {
+template <typename Out>
+inline void write_str(Out &out, std::string_view s) {
   write_size(out, s.length());
-  for (char c : s) {
-    detail::write(out, c);
-  }
+  detail::write_bytes(out, s.data(), s.length());
 }
 
-inline uint32_t read_u32(std::istream &in) {
+template <typename In>
+inline uint32_t read_u32(In &in) {
   return detail::read<uint32_t>(in);
 }
-inline uint64_t read_u64(std::istream &in) {
+template <typename In>
+inline uint64_t read_u64(In &in) {
   return detail::read<uint64_t>(in);
 }
-inline std::size_t read_size(std::istream &in) {
+template <typename In>
+inline std::size_t read_size(In &in) {
   return detail::read<std::size_t>(in);
 }
-template <typename T>
-inline T *read_ptr(std::istream &in) {
+template <typename T, typename In>
+inline T *read_ptr(In &in) {
   return reinterpret_cast<T *>(detail::read<std::uintptr_t>(in));
 }
-inline std::string read_str(std::istream &in) {
+template <typename In>
+inline void read_str(In &in, std::string &s) {
   const size_t len = read_size(in);
-  std::string ans(len, '\0');
-  for (std::size_t i = 0; i < len; i++) {
-    ans[i] = detail::read<char>(in);
-  }
+  s.resize(len);
+  detail::read_bytes(in, s.data(), len);
+}
+template <typename In>
+inline std::string read_str(In &in) {
+  std::string ans;
+  read_str(in, ans);
   return ans;
 }
 }  // namespace serde::io
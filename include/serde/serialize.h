@@ -1,81 +1,338 @@
 #ifndef SERDE_SERIALIZE__H
 #define SERDE_SERIALIZE__H
 
+#include <algorithm>
+#include <cassert>
+#include <chrono>
 #include <cstdint>
 #include <cstdlib>
 #include <filesystem>
-#include <fstream>
 #include <functional>
+#include <future>
+#include <memory>
+#include <numeric>
+#include <optional>
 #include <ostream>
+#include <random>
 #include <tuple>
 #include <type_traits>
-#include <unordered_map>
 #include <utility>
 #include <vector>
 
 #include "ast/ast_fwd.h"
+#include "ast/context.h"
 #include "ast/decl.h"
+#include "ast/dispatch.h"
 #include "ast/expr.h"
 #include "ast/stmt.h"
 #include "ast/type.h"
 #include "pool.h"
 #include "reflect/access.h"
+#include "reflect/plain.h"
+#include "serde/codec.h"
+#include "serde/container.h"
 #include "serde/encoder.h"
 #include "serde/io.h"
+#include "serde/size.h"
 #include "utility/logging.h"
+#include "utility/save_restore.h"
+#include "utility/thread_pool.h"
 
 namespace serde {
+/// Saves the AST held by an `ASTContext` into a single snapshot file (see `SnapshotWriter`), one
+/// section per node class.
+///
+/// `path` is the file to write, or a directory to write `kSnapshotFileName` into. The file is
+/// replaced atomically. `io::Format::kCompact` trades a little CPU for much smaller sections, and
+/// so does compressing them with `codec`.
+///
+/// Pools are encoded, and compressed, in parallel on the shared thread pool, each into its own
+/// buffer, which a `BackgroundWriter` appends to the file as soon as it is ready. `save` must thus
+/// not be called from a task running on that pool.
 class ASTSaver {
  public:
-  ASTSaver(const std::filesystem::path &dir) : _dir{dir} {}
+  ASTSaver(ast::ASTContext &ctx, const std::filesystem::path &path,
+           io::Format format = io::Format::kFixed, CodecId codec = CodecId::kNone)
+      : _ctx{ctx}, _path{path}, _format{format}, _codec{codec} {}
+  ASTSaver(const std::filesystem::path &path, io::Format format = io::Format::kFixed,
+           CodecId codec = CodecId::kNone)
+      : ASTSaver{ast::ASTContext::global(), path, format, codec} {}
 
+  /// Writes a full snapshot, then drops the deltas of the previous one.
   void save() {
+    save_async().get();
+  }
+
+  /// Like `save`, but returns once the snapshot is encoded: a background thread writes and syncs
+  /// it while the caller goes on, and the future tells when the file is in place, or rethrows
+  /// what went wrong. The context can be modified right away. The next save of the context waits
+  /// for this one first, see `ast::ASTContext::wait_for_save`.
+  std::shared_future<void> save_async() {
+    _ctx.wait_for_save();
+    // Nodes still in a lazily loaded snapshot would otherwise be saved as free slots.
+    _ctx.load_lazy_nodes();
+
     INFO("Saving pools");
-    save_pools(std::make_index_sequence<std::tuple_size_v<ast::Nodes> - 1>());
-
-    INFO("Saving address mapping");
-    auto index_stream = std::ofstream{_dir / "index.db", std::ios::binary};
-    for (const auto &[cls_id, xs] : _addr) {
-      io::detail::write(index_stream, cls_id);
-      io::write_size(index_stream, xs.size());
-      for (auto x : xs) {
-        io::write_u64(index_stream, x);
-      }
+    const auto path = snapshot_path(_path);
+    // Stale deltas would be ignored anyway, see `SnapshotInfo`.
+    BackgroundWriter writer{
+        std::make_unique<SnapshotWriter>(path, _format, 2 * ast::kNumNodeClasses + 2, _codec),
+        [path] {
+          std::error_code ec;
+          for (std::uint32_t n = 1; std::filesystem::remove(delta_path(path, n), ec); n++) {
+          }
+        }};
+    detail::StringTable strings;
+    encode_pools(strings, [this, &writer](auto tag) {
+      using T = typename decltype(tag)::type;
+      std::vector<std::uint32_t> node_sizes;
+      const std::size_t raw_length = section_size<T>();
+      auto section = writer.encode_section(
+          [this, &node_sizes](io::BufferedWriter &out_s) { node_sizes = save_pool<T>(out_s); },
+          raw_length);
+      assert(!raw_length || section.raw_length == raw_length);
+      writer.push(T::kClassID, std::move(section));
+      // Fixed-size nodes are found without an index, see `ASTLoader`.
+      if (detail::has_fixed_size<T>(_format))
+        return;
+      writer.push(node_index_section(T::kClassID),
+                  writer.encode_section([&node_sizes](io::BufferedWriter &out_s) {
+                    io::write_size(out_s, node_sizes.size());
+                    for (auto n : node_sizes)
+                      out_s.write_varint(n);
+                  }));
+    });
+    write_strings(writer, strings);
+    const std::uint64_t base_id = new_base_id();
+    write_info(writer, {base_id, 0});
+    _ctx.clear_dirty();
+    _ctx.set_snapshot_state({{base_id, 0}});
+    return finish(writer);
+  }
+
+  /// Saves the nodes changed since the context was last saved or loaded as the next delta of the
+  /// snapshot at `path`, see `ast::Pool::mark_dirty`; `ASTLoader` replays the deltas on top of
+  /// the snapshot. Compacts instead, that is, calls `save`, when the snapshot at `path` and its
+  /// deltas are not what the context was last saved to or loaded from, after `kMaxDeltas` deltas,
+  /// once the changes make up more than `1 / kMaxDirtyShare` of the slots, or when a pool was
+  /// cleared or compacted since.
+  void save_delta() {
+    save_delta_async().get();
+  }
+
+  /// `save_delta` as `save_async` is to `save`.
+  std::shared_future<void> save_delta_async() {
+    // The base and the deltas on disk must be those of the last save.
+    _ctx.wait_for_save();
+    const auto path = snapshot_path(_path);
+    std::optional<SnapshotInfo> base;
+    if (std::filesystem::exists(path))
+      base = read_info(SnapshotReader{path, LoadMode::kStream});
+    std::uint32_t n = 1;
+    while (base && n <= kMaxDeltas && std::filesystem::exists(delta_path(path, n)) &&
+           read_info(SnapshotReader{delta_path(path, n), LoadMode::kStream}) ==
+               SnapshotInfo{base->base_id, n})
+      n++;
+    std::size_t num_slots = 0;
+    std::size_t num_dirty = 0;
+    bool all_dirty = false;
+    for (std::size_t i = 0; i < ast::kNumNodeClasses; i++) {
+      ast::with_node_class(i, [&](auto tag) {
+        const auto &pool = _ctx.pool<typename decltype(tag)::type>();
+        num_slots += pool.num_slots();
+        num_dirty += pool.num_dirty();
+        all_dirty |= pool.all_dirty();
+      });
     }
+    // The dirty slots are only the changes since that file.
+    const auto &saved = _ctx.snapshot_state();
+    const bool same_file =
+        base && saved && saved->base_id == base->base_id && saved->num_deltas == n - 1;
+    if (!same_file || n > kMaxDeltas || all_dirty || num_dirty * kMaxDirtyShare > num_slots) {
+      INFO("Compacting into a full snapshot");
+      return save_async();
+    }
+
+    INFO("Saving delta {}, {} changed slot(s)", n, num_dirty);
+    _ctx.pool<ast::FuncDecl>().for_each_dirty([this](std::size_t i) {
+      if (auto &pool = _ctx.pool<ast::FuncDecl>(); pool.is_live(i))
+        pool.at(i).get_body();
+    });
+    BackgroundWriter writer{std::make_unique<SnapshotWriter>(
+        delta_path(path, n), _format, ast::kNumNodeClasses + 2, _codec)};
+    detail::StringTable strings;
+    encode_pools(strings, [this, &writer](auto tag) {
+      using T = typename decltype(tag)::type;
+      writer.push(T::kClassID, writer.encode_section(
+                                   [this](io::BufferedWriter &out_s) { save_changes<T>(out_s); }));
+    });
+    write_strings(writer, strings);
+    write_info(writer, {base->base_id, n});
+    _ctx.clear_dirty();
+    _ctx.set_snapshot_state({{base->base_id, n}});
+    return finish(writer);
   }
 
+  /// Deltas kept before `save_delta` compacts.
+  static constexpr std::uint32_t kMaxDeltas = 8;
+  /// `save_delta` compacts once more than one slot in this many changed.
+  static constexpr std::size_t kMaxDirtyShare = 4;
+
  private:
-  template <std::size_t... Is>
-  void save_pools(std::index_sequence<Is...>) {
-    (save_pool<std::tuple_element_t<Is, ast::Nodes>>(), ...);
+  /// Calls `encode(ast::TypeTag<T>)` for each node class on a task of its own, largest pools
+  /// first, with a `detail::SaveState` interning into `strings`.
+  template <typename F>
+  void encode_pools(detail::StringTable &strings, F &&encode) {
+    // Largest pools first, so that they do not start last and hold everything up.
+    std::vector<std::size_t> sizes(ast::kNumNodeClasses);
+    for (std::size_t i = 0; i < ast::kNumNodeClasses; i++) {
+      ast::with_node_class(i, [this, &sizes, i](auto tag) {
+        sizes[i] = _ctx.pool<typename decltype(tag)::type>().num_slots();
+      });
+    }
+    std::vector<std::size_t> order(ast::kNumNodeClasses);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&sizes](std::size_t a, std::size_t b) { return sizes[a] > sizes[b]; });
+
+    utility::concurrency::parallel_for(order.size(), 1, [&](std::size_t begin, std::size_t end) {
+      detail::SaveState state{&strings};
+      SAVE_RESTORE(detail::save_state, &state);
+      for (std::size_t k = begin; k < end; k++)
+        ast::with_node_class(order[k], encode);
+    });
   }
 
+  /// Lets `writer` commit, and has the context wait for it before its next save.
+  std::shared_future<void> finish(BackgroundWriter &writer) {
+    auto written = writer.finish().share();
+    _ctx.set_pending_save(written);
+    return written;
+  }
+
+  static void write_strings(BackgroundWriter &writer, const detail::StringTable &strings) {
+    INFO("Saving {} distinct string(s)", strings.strings().size());
+    writer.push(kStringTableSection, writer.encode_section([&strings](io::BufferedWriter &out_s) {
+      io::write_u32(out_s, static_cast<std::uint32_t>(strings.strings().size()));
+      for (const auto &s : strings.strings())
+        io::write_str(out_s, s);
+    }));
+  }
+
+  static std::uint64_t new_base_id() {
+    std::random_device random;
+    return (std::uint64_t{random()} << 32 | random()) ^
+           static_cast<std::uint64_t>(std::chrono::system_clock::now().time_since_epoch().count());
+  }
+
+  /// What `save_pool<T>` writes in `io::Format::kFixed`, 0 in other formats. Walks the nodes
+  /// unless they all take the same room.
+  template <typename T>
+  std::size_t section_size() {
+    if (_format != io::Format::kFixed)
+      return 0;
+    auto &pool = _ctx.pool<T>();
+    const std::size_t num_dead = pool.num_slots() - pool.num_nodes();
+    std::size_t size = 2 * sizeof(std::size_t) + num_dead * sizeof(std::uint32_t);
+    if constexpr (detail::kSerializedSize<T> != detail::kVariableSize) {
+      size += pool.num_nodes() * detail::kSerializedSize<T>;
+    } else {
+      pool.for_each([&size](std::size_t, const T &node) { size += detail::serialized_size(node); });
+    }
+    return size;
+  }
+
+  /// Writes the number of slots, the slots that are not live, then every live node in slot
+  /// order. Nodes thus keep their slot indices, which pointers and `NodeRef`s refer to. Returns
+  /// the encoded size of each node, or nothing for plain nodes in `io::Format::kFixed`, which need
+  /// no index.
   template <typename T>
-  void save_pool() {
-    auto &pool = ast::Pool<T>::instance();
+  std::vector<std::uint32_t> save_pool(io::BufferedWriter &out_s) {
+    auto &pool = _ctx.pool<T>();
     DEBUG("Begin saving pool of {}, {} node(s)", T::kClassName, pool.num_nodes());
-    auto p = _dir / T::kClassName;
-    std::ofstream out_s{p, std::ios::binary};
-    io::write_size(out_s, pool.num_nodes());
-    auto &addr = _addr[T::kClassID];
-    addr.resize(pool.num_nodes());
-    pool.for_each([&out_s, &addr](std::size_t i, const T &node) {
+
+    std::vector<std::uint32_t> dead;
+    std::size_t next = 0;
+    pool.for_each([&dead, &next](std::size_t i, const T &) {
+      for (; next < i; next++)
+        dead.push_back(static_cast<std::uint32_t>(next));
+      next = i + 1;
+    });
+    for (; next < pool.num_slots(); next++)
+      dead.push_back(static_cast<std::uint32_t>(next));
+    io::write_size(out_s, pool.num_slots());
+    io::write_size(out_s, dead.size());
+    for (auto i : dead)
+      io::write_u32(out_s, i);
+
+    if constexpr (reflect::is_plain_node_v<T>) {
+      if (out_s.format() == io::Format::kFixed) {
+        save_plain_nodes(pool, out_s);
+        DEBUG("End saving pool of {}", T::kClassName);
+        return {};
+      }
+    }
+    std::vector<std::uint32_t> node_sizes;
+    node_sizes.reserve(pool.num_nodes());
+    pool.for_each([&out_s, &node_sizes](std::size_t i, const T &node) {
       DEBUG("Saving #{}, addr is {}", i, static_cast<const void *>(&node));
+      const std::size_t start = out_s.position();
       save_node(node, out_s);
-      addr[i] = reinterpret_cast<std::uintptr_t>(&node);
+      node_sizes.push_back(static_cast<std::uint32_t>(out_s.position() - start));
     });
     DEBUG("End saving pool of {}", T::kClassName);
+    return node_sizes;
   }
 
+  /// Writes the number of slots, the changed slots in ascending order, each with whether it is
+  /// live, then the live ones among them in the same order.
   template <typename T>
-  static void save_node(const T &node, std::ostream &out_s) {
+  void save_changes(io::BufferedWriter &out_s) {
+    const auto &pool = _ctx.pool<T>();
+    std::vector<std::uint32_t> changed;
+    changed.reserve(pool.num_dirty());
+    pool.for_each_dirty(
+        [&changed](std::size_t i) { changed.push_back(static_cast<std::uint32_t>(i)); });
+    std::sort(changed.begin(), changed.end());
+    DEBUG("Saving {} changed slot(s) of {}", changed.size(), T::kClassName);
+
+    io::write_size(out_s, pool.num_slots());
+    io::write_size(out_s, changed.size());
+    for (auto i : changed) {
+      io::write_u32(out_s, i);
+      out_s.write_value<std::uint8_t>(pool.is_live(i));
+    }
+    for (auto i : changed) {
+      if (pool.is_live(i))
+        save_node(pool.at(i), out_s);
+    }
+  }
+
+  /// Gathers the fields of every live node into one buffer and writes it in one go; the bytes are
+  /// those `save_node` would write for each in turn.
+  template <typename T>
+  static void save_plain_nodes(ast::Pool<T> &pool, io::BufferedWriter &out_s) {
+    using Plain = reflect::PlainNode<T>;
+    static_assert(Plain::kSize == detail::kSerializedSize<T>);
+    std::unique_ptr<char[]> bytes{new char[pool.num_nodes() * Plain::kSize]};
+    char *out = bytes.get();
+    pool.for_each([&out](std::size_t, const T &node) {
+      Plain::save(node, out);
+      out += Plain::kSize;
+    });
+    out_s.write(bytes.get(), pool.num_nodes() * Plain::kSize);
+  }
+
+  template <typename T>
+  static void save_node(const T &node, io::BufferedWriter &out_s) {
     detail::DataEncoder<T>{}(out_s, node);
   }
 
  private:
-  std::filesystem::path _dir;
-
-  std::unordered_map</* Class ID */ int, std::vector<std::uintptr_t>> _addr;
+  ast::ASTContext &_ctx;
+  std::filesystem::path _path;
+  io::Format _format;
+  CodecId _codec;
 };
 }  // namespace serde
 
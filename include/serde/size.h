@@ -0,0 +1,181 @@
+#ifndef SERDE_SIZE__H
+#define SERDE_SIZE__H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "ast/node_ref.h"
+#include "reflect/access.h"
+#include "serde/encoder.h"
+#include "serde/io.h"
+
+namespace serde::detail {
+/// `SerializedSize::kSize` of types whose values do not all take the same room.
+inline constexpr std::size_t kVariableSize = ~std::size_t{0};
+
+/// How many bytes `DataEncoder<T>` writes in `io::Format::kFixed`: `kSize` when it is the same for
+/// every value, `kVariableSize` otherwise, and `operator()` for a given value. Strings count as
+/// variable even though they are IDs when there is a `SaveState::strings`.
+template <typename T, typename = void>
+struct SerializedSize;
+
+template <typename T>
+inline constexpr std::size_t kSerializedSize = SerializedSize<T>::kSize;
+
+template <typename T>
+std::size_t serialized_size(const T &value) {
+  return SerializedSize<T>{}(value);
+}
+
+/// Whether every node of `T` takes the same room in `format`. Snapshots have no node index for
+/// such sections; `ASTSaver` and `ASTLoader` both ask here so that they agree on it.
+template <typename T>
+bool has_fixed_size(io::Format format) {
+  return format == io::Format::kFixed && kSerializedSize<T> != kVariableSize;
+}
+
+namespace size_detail {
+template <typename... Ns>
+constexpr std::size_t sum(Ns... ns) {
+  std::size_t n = 0;
+  ((n = n == kVariableSize || ns == kVariableSize ? kVariableSize : n + ns), ...);
+  return n;
+}
+
+template <typename T, std::size_t I>
+constexpr std::size_t field_size() {
+  using Field = typename reflect::Access<T>::template FieldAt<I>;
+  if constexpr (Field::is_transient)
+    return 0;
+  else
+    return kSerializedSize<typename Field::type>;
+}
+
+template <typename T, std::size_t... Is>
+constexpr std::size_t node_size(std::index_sequence<Is...>) {
+  using Access = reflect::Access<T>;
+  if constexpr (Access::kHasSuper)
+    return sum(kSerializedSize<typename Access::super_type>, field_size<T, Is>()...);
+  else
+    return sum(field_size<T, Is>()...);
+}
+}  // namespace size_detail
+
+template <typename T>
+struct SerializedSize<const T> : SerializedSize<T> {};
+
+template <typename T>
+struct SerializedSize<T, std::enable_if_t<std::is_fundamental_v<T> || std::is_enum_v<T>>> {
+  static constexpr std::size_t kSize = sizeof(T);
+
+  std::size_t operator()(T) {
+    return kSize;
+  }
+};
+
+/// Null node pointers take only their class.
+template <typename T>
+struct SerializedSize<T *> {
+  static constexpr std::size_t kSize =
+      reflect::is_ast_node_v<T> ? kVariableSize : sizeof(std::uintptr_t);
+
+  std::size_t operator()(const T *ptr) {
+    if constexpr (reflect::is_ast_node_v<T>)
+      return ptr ? 2 * sizeof(std::uint32_t) : sizeof(std::uint32_t);
+    else
+      return kSize;
+  }
+};
+
+template <typename T>
+struct SerializedSize<ast::NodeRef<T>> {
+  static constexpr std::size_t kSize = sizeof(std::uint32_t);
+
+  std::size_t operator()(ast::NodeRef<T>) {
+    return kSize;
+  }
+};
+
+template <typename T>
+struct SerializedSize<std::vector<T>> {
+  static constexpr std::size_t kSize = kVariableSize;
+
+  std::size_t operator()(const std::vector<T> &xs) {
+    if constexpr (kSerializedSize<T> != kVariableSize) {
+      return sizeof(std::size_t) + xs.size() * kSerializedSize<T>;
+    } else {
+      std::size_t n = sizeof(std::size_t);
+      for (const auto &x : xs)
+        n += serialized_size(x);
+      return n;
+    }
+  }
+};
+
+template <>
+struct SerializedSize<std::string_view> {
+  static constexpr std::size_t kSize = kVariableSize;
+
+  std::size_t operator()(std::string_view s) {
+    if (save_state && save_state->strings)
+      return sizeof(std::uint32_t);
+    return sizeof(std::size_t) + s.size();
+  }
+};
+
+template <>
+struct SerializedSize<std::string> : SerializedSize<std::string_view> {};
+
+template <typename... Ts>
+struct SerializedSize<std::tuple<Ts...>> {
+  static constexpr std::size_t kSize = size_detail::sum(kSerializedSize<Ts>...);
+
+  std::size_t operator()(const std::tuple<Ts...> &xs) {
+    return std::apply(
+        [](const auto &...x) { return (std::size_t{0} + ... + serialized_size(x)); }, xs);
+  }
+};
+
+/// The super classes, then every field that is not transient.
+template <typename T>
+struct SerializedSize<T, std::enable_if_t<reflect::is_ast_node_v<T>>> {
+  using Access = reflect::Access<T>;
+
+  static constexpr std::size_t kSize =
+      size_detail::node_size<T>(std::make_index_sequence<Access::kNumFields>{});
+
+  std::size_t operator()(const T &object) {
+    if constexpr (kSize != kVariableSize) {
+      return kSize;
+    } else {
+      std::size_t n = 0;
+      if constexpr (Access::kHasSuper)
+        n += serialized_size(static_cast<const typename Access::super_type &>(object));
+      return n + fields(object, std::make_index_sequence<Access::kNumFields>{});
+    }
+  }
+
+ private:
+  template <std::size_t... Is>
+  std::size_t fields(const T &object, std::index_sequence<Is...>) {
+    return (std::size_t{0} + ... + field<Is>(object));
+  }
+
+  template <std::size_t I>
+  std::size_t field(const T &object) {
+    using Field = typename Access::template FieldAt<I>;
+    if constexpr (Field::is_transient)
+      return 0;
+    else
+      return serialized_size(object.*Field::pointer);
+  }
+};
+}  // namespace serde::detail
+
+#endif  // SERDE_SIZE__H
@@ -0,0 +1,101 @@
+#ifndef UTILITY_MAPPED_FILE__H
+#define UTILITY_MAPPED_FILE__H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <filesystem>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+namespace utility {
+/// A read-only, private memory mapping of a whole file, unmapped on destruction.
+class MappedFile {
+ public:
+  /// How the mapping will be read, which tells the kernel what to read ahead.
+  enum class Access {
+    /// Front to back once: read ahead aggressively and drop pages behind.
+    kSequential,
+    /// At scattered offsets: read only the pages touched.
+    kRandom,
+  };
+
+ public:
+  MappedFile() = default;
+  explicit MappedFile(const std::filesystem::path &path, Access access = Access::kSequential) {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      throw std::system_error{errno, std::generic_category(), path.string()};
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+      const int error = errno;
+      ::close(fd);
+      throw std::system_error{error, std::generic_category(), path.string()};
+    }
+    _size = static_cast<std::size_t>(st.st_size);
+    if (_size) {
+      void *data = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        const int error = errno;
+        ::close(fd);
+        throw std::system_error{error, std::generic_category(), path.string()};
+      }
+      _data = static_cast<const char *>(data);
+      advise(access);
+    }
+    // The mapping stays valid after the descriptor is closed.
+    ::close(fd);
+  }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  MappedFile(MappedFile &&other) noexcept
+      : _data{std::exchange(other._data, nullptr)}, _size{std::exchange(other._size, 0)} {}
+  MappedFile &operator=(MappedFile &&other) noexcept {
+    if (this != &other) {
+      unmap();
+      _data = std::exchange(other._data, nullptr);
+      _size = std::exchange(other._size, 0);
+    }
+    return *this;
+  }
+  ~MappedFile() {
+    unmap();
+  }
+
+ public:
+  const char *data() const {
+    return _data;
+  }
+  std::size_t size() const {
+    return _size;
+  }
+  std::string_view bytes() const {
+    return {_data, _size};
+  }
+
+  /// Changes how the mapping is expected to be read from now on. Only a hint, so errors are
+  /// ignored.
+  void advise(Access access) const {
+    if (_data)
+      ::madvise(const_cast<char *>(_data), _size,
+                access == Access::kSequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+  }
+
+ private:
+  void unmap() {
+    if (_data)
+      ::munmap(const_cast<char *>(_data), _size);
+  }
+
+ private:
+  const char *_data{nullptr};
+  std::size_t _size{0};
+};
+}  // namespace utility
+
+#endif  // UTILITY_MAPPED_FILE__H
@@ -0,0 +1,45 @@
+#ifndef UTILITY_RADIX_SORT__H
+#define UTILITY_RADIX_SORT__H
+
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace utility {
+/// Sorts `items` by `key(item)`, an unsigned integer, keeping equal keys in order. One counting
+/// pass per byte of the keys, skipping the bytes that are the same in every key.
+template <typename T, typename KeyFn>
+void radix_sort(std::vector<T> &items, KeyFn &&key) {
+  using Key = std::decay_t<std::invoke_result_t<KeyFn &, const T &>>;
+  static_assert(std::is_unsigned_v<Key>);
+  if (items.size() < 2)
+    return;
+  Key any_set = 0;
+  Key all_set = ~Key{0};
+  for (const auto &item : items) {
+    const Key k = key(item);
+    any_set |= k;
+    all_set &= k;
+  }
+  const Key varying = any_set ^ all_set;
+  std::vector<T> sorted(items.size());
+  for (unsigned shift = 0; shift < sizeof(Key) * 8; shift += 8) {
+    if (!(varying >> shift & 0xff))
+      continue;
+    std::array<std::size_t, 256> starts{};
+    for (const auto &item : items)
+      starts[key(item) >> shift & 0xff]++;
+    std::size_t sum = 0;
+    for (auto &start : starts)
+      sum += std::exchange(start, sum);
+    for (auto &item : items)
+      sorted[starts[key(item) >> shift & 0xff]++] = std::move(item);
+    items.swap(sorted);
+  }
+}
+}  // namespace utility
+
+#endif  // UTILITY_RADIX_SORT__H
@@ -20,9 +20,12 @@ class SaveRestore {
 };
 }  // namespace utility::raii
 
-#define SAVE_RESTORE(var, new_value)          \
-  ::utility::raii::SaveRestore _g##__LINE__ { \
-    var, new_value                            \
+#define _SAVE_RESTORE_CAT2(a, b) a##b
+#define _SAVE_RESTORE_CAT(a, b) _SAVE_RESTORE_CAT2(a, b)
+
+#define SAVE_RESTORE(var, new_value)                             \
+  ::utility::raii::SaveRestore _SAVE_RESTORE_CAT(_g, __LINE__) { \
+    var, new_value                                               \
   }
 
 #endif  // SAVE_RESTORE__H
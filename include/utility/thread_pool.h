@@ -0,0 +1,131 @@
+#ifndef UTILITY_THREAD_POOL__H
+#define UTILITY_THREAD_POOL__H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace utility::concurrency {
+/// A fixed set of worker threads running submitted tasks in FIFO order.
+class ThreadPool {
+ public:
+  explicit ThreadPool(std::size_t n_threads = default_concurrency()) {
+    _workers.reserve(n_threads);
+    for (std::size_t i = 0; i < n_threads; i++) {
+      _workers.emplace_back([this] { work(); });
+    }
+  }
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+  ~ThreadPool() {
+    {
+      std::lock_guard lock{_mutex};
+      _stopping = true;
+    }
+    _cv.notify_all();
+    for (auto &t : _workers) {
+      t.join();
+    }
+  }
+
+  /// A process-wide pool with one worker per hardware thread.
+  static ThreadPool &shared() {
+    static ThreadPool singleton;
+    return singleton;
+  }
+
+  static std::size_t default_concurrency() {
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+
+ public:
+  std::size_t size() const {
+    return _workers.size();
+  }
+
+  template <typename F>
+  auto submit(F &&func) -> std::future<std::invoke_result_t<std::decay_t<F>>> {
+    using R = std::invoke_result_t<std::decay_t<F>>;
+    auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(func));
+    auto result = task->get_future();
+    {
+      std::lock_guard lock{_mutex};
+      _tasks.emplace_back([task] { (*task)(); });
+    }
+    _cv.notify_one();
+    return result;
+  }
+
+ private:
+  void work() {
+    for (;;) {
+      std::function<void()> task;
+      {
+        std::unique_lock lock{_mutex};
+        _cv.wait(lock, [this] { return _stopping || !_tasks.empty(); });
+        if (_tasks.empty())
+          return;
+        task = std::move(_tasks.front());
+        _tasks.pop_front();
+      }
+      task();
+    }
+  }
+
+ private:
+  std::vector<std::thread> _workers;
+  std::deque<std::function<void()>> _tasks;
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  bool _stopping{false};
+};
+
+/// Calls `func(begin, end)` on consecutive sub-ranges of `[0, n)` of about `grain` items, in
+/// parallel on `pool`; the calling thread takes the first range. Returns once all are done and
+/// rethrows the first exception, if any. Must not be called from a task running on `pool`.
+template <typename F>
+void parallel_for(std::size_t n, std::size_t grain, F &&func,
+                  ThreadPool &pool = ThreadPool::shared()) {
+  grain = std::max<std::size_t>(grain, 1);
+  if (n <= grain) {
+    if (n)
+      func(std::size_t{0}, n);
+    return;
+  }
+  std::vector<std::future<void>> pending;
+  pending.reserve(n / grain);
+  for (std::size_t begin = grain; begin < n; begin += grain) {
+    const std::size_t end = std::min(n, begin + grain);
+    pending.push_back(pool.submit([&func, begin, end] { func(begin, end); }));
+  }
+  std::exception_ptr error;
+  try {
+    func(std::size_t{0}, grain);
+  } catch (...) {
+    error = std::current_exception();
+  }
+  // Wait for every range before rethrowing: they all refer to `func`.
+  for (auto &f : pending) {
+    try {
+      f.get();
+    } catch (...) {
+      if (!error)
+        error = std::current_exception();
+    }
+  }
+  if (error)
+    std::rethrow_exception(error);
+}
+}  // namespace utility::concurrency
+
+#endif  // UTILITY_THREAD_POOL__H
@@ -0,0 +1,57 @@
+#include "serde/codec.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+std::string roundtrip(const serde::Codec &codec, const std::string &input) {
+  std::string compressed;
+  codec.compress(input.data(), input.size(), compressed);
+  std::string output(input.size(), '\0');
+  codec.decompress(compressed.data(), compressed.size(), output.data(), output.size());
+  return output;
+}
+}  // namespace
+
+TEST(Codec, Lz) {
+  const auto &lz = serde::codec_for(serde::CodecId::kLz);
+  EXPECT_EQ(lz.id(), serde::CodecId::kLz);
+
+  std::string pseudo_random(5000, '\0');
+  std::uint32_t x = 7;
+  for (auto &c : pseudo_random) {
+    x = x * 1664525 + 1013904223;
+    c = static_cast<char>(x >> 24);
+  }
+  const std::vector<std::string> inputs{
+      "",
+      "a",
+      "abcabcabcabc",
+      std::string(1000, '\0'),
+      std::string(40, 'x') + "yz" + std::string(300, 'x'),
+      pseudo_random,
+      pseudo_random + pseudo_random.substr(100, 2000),
+  };
+  for (const auto &input : inputs)
+    EXPECT_EQ(roundtrip(lz, input), input);
+
+  std::string compressed;
+  lz.compress(inputs[3].data(), inputs[3].size(), compressed);
+  EXPECT_LT(compressed.size(), 20);
+
+  // A match reaching before the start of the output.
+  const std::string corrupt{"\x14" "a" "\x05\x00", 4};
+  std::string output(10, '\0');
+  EXPECT_THROW(lz.decompress(corrupt.data(), corrupt.size(), output.data(), output.size()),
+               std::runtime_error);
+}
+
+TEST(Codec, None) {
+  const auto &none = serde::codec_for(serde::CodecId::kNone);
+  EXPECT_EQ(roundtrip(none, "hello"), "hello");
+  EXPECT_THROW(serde::codec_for(static_cast<serde::CodecId>(42)), std::runtime_error);
+}
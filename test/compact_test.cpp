@@ -0,0 +1,158 @@
+#include "ast/compact.h"
+
+#include <gtest/gtest.h>
+
+#include <utility>
+#include <vector>
+
+#include "ast/api/pretty_print.h"
+#include "ast/context.h"
+#include "ast/decl.h"
+#include "ast/expr.h"
+#include "ast/node_ref.h"
+#include "ast/type.h"
+#include "pool.h"
+#include "reflect/model.h"
+
+// func add(a: i32, b: i32) -> i32 {
+//   var c: i32 = a;
+//   c - b
+// }
+// with garbage nodes interleaved and destroyed.
+TEST(Compaction, Basic) {
+  auto &ints = ast::Pool<ast::IntegralType>::instance();
+  auto &refs = ast::Pool<ast::DeclRefExpr>::instance();
+  std::vector<ast::DeclRefExpr *> garbage;
+  auto make_garbage = [&] { garbage.push_back(refs.create("garbage")); };
+
+  make_garbage();
+  auto *i32 = ints.create(true, 32);
+  make_garbage();
+  auto *var_c = ast::Pool<ast::VarDecl>::instance().create("c", i32);
+  auto *ref_c = refs.create(var_c);
+  make_garbage();
+  auto *stmt = ast::Pool<ast::DeclStmt>::instance().create(var_c);
+  auto *sub = ast::Pool<ast::BinaryExpr>::instance().create(ast::BinaryExpr::kSub, ref_c,
+                                                            refs.create("b"));
+  auto *body = ast::Pool<ast::BlockExpr>::instance().create(std::vector<ast::Stmt *>{stmt}, sub);
+  auto *fn = ast::Pool<ast::FuncDecl>::instance().create(
+      "add", std::vector<ast::FuncDecl::ParamSpec>{{"a", i32}, {"b", i32}}, i32, body);
+  auto *cu = ast::Pool<ast::CompilationUnitDecl>::instance().create("_unit_");
+  cu->decls.push_back(fn);
+  for (auto *x : garbage) {
+    refs.destroy(x);
+  }
+
+  const auto expected = ast::to_string(*cu);
+  ASSERT_EQ(refs.num_slots(), 5);
+  ASSERT_EQ(refs.num_nodes(), 2);
+
+  ast::compact_pools();
+
+  EXPECT_EQ(refs.num_slots(), 2);
+  EXPECT_EQ(refs.num_nodes(), 2);
+
+  // DFS pre-order: `c` is reached before `b`.
+  auto &new_cu = ast::Pool<ast::CompilationUnitDecl>::instance().at(0);
+  EXPECT_EQ(ast::to_string(new_cu), expected);
+  EXPECT_EQ(refs.at(0).decl, &ast::Pool<ast::VarDecl>::instance().at(0));
+  EXPECT_EQ(refs.at(1).name, "b");
+
+  // Incoming pointers and user sets follow the nodes.
+  auto &new_fn = ast::Pool<ast::FuncDecl>::instance().at(0);
+  EXPECT_EQ(new_cu.decls[0], &new_fn);
+  EXPECT_EQ(new_fn.body, &ast::Pool<ast::BlockExpr>::instance().at(0));
+  auto &new_c = ast::Pool<ast::VarDecl>::instance().at(0);
+  EXPECT_EQ(new_c.type, &ints.at(0));
+  ASSERT_EQ(new_c.users.size(), 1);
+  EXPECT_EQ(*new_c.users.begin(), static_cast<void *>(&refs.at(0)));
+}
+
+// var x: i32 = 42; with the literal moved down by compaction.
+TEST(Compaction, VarDeclInit) {
+  ast::ASTContext ctx;
+  auto &literals = ctx.pool<ast::IntegerLiteralExpr>();
+  auto *garbage = ctx.create<ast::IntegerLiteralExpr>(0);
+  auto *i32 = ctx.create<ast::IntegralType>(true, 32);
+  auto *x = ctx.create<ast::VarDecl>("x", i32, ctx.create<ast::IntegerLiteralExpr>(42));
+  ctx.create<ast::CompilationUnitDecl>("_unit_")->decls.push_back(x);
+  ctx.destroy(garbage);
+
+  ast::compact_pools(ctx);
+
+  ASSERT_EQ(literals.num_slots(), 1);
+  auto &new_x = ctx.pool<ast::VarDecl>().at(0);
+  EXPECT_EQ(new_x.init_val, &literals.at(0));
+  EXPECT_EQ(literals.at(0).value, 42);
+}
+
+// var x: i32; x; with the reference destroyed, then its slot reused by one to nothing.
+TEST(Compaction, DestroyedUser) {
+  ast::ASTContext ctx;
+  auto *x = ctx.create<ast::VarDecl>("x", ctx.create<ast::IntegralType>(true, 32));
+  auto *body = ctx.create<ast::BlockExpr>(std::vector<ast::Stmt *>{},
+                                          ctx.create<ast::DeclRefExpr>(x));
+  auto *cu = ctx.create<ast::CompilationUnitDecl>("_unit_");
+  cu->decls.push_back(x);
+  ASSERT_EQ(x->users.size(), 1);
+
+  ctx.destroy(static_cast<ast::DeclRefExpr *>(std::exchange(body->last_expr, nullptr)));
+  ast::compact_pools(ctx);
+  EXPECT_TRUE(ctx.pool<ast::VarDecl>().at(0).users.empty());
+
+  auto &new_x = ctx.pool<ast::VarDecl>().at(0);
+  auto *ref = ctx.create<ast::DeclRefExpr>(&new_x);
+  ctx.destroy(ref);
+  ctx.pool<ast::BlockExpr>().at(0).last_expr = ctx.create<ast::DeclRefExpr>("y");
+  ASSERT_EQ(new_x.users.size(), 1);
+  ast::compact_pools(ctx);
+  EXPECT_TRUE(ctx.pool<ast::VarDecl>().at(0).users.empty());
+  EXPECT_EQ(ctx.pool<ast::DeclRefExpr>().at(0).name, "y");
+}
+
+// Refers to a node both ways; reflected, but held outside the pools.
+struct Holder {
+  ast::Expr *ptr;
+  ast::NodeRef<ast::Expr> ref;
+
+  META_INFO(Holder, 0, void, ptr, ref);
+};
+
+TEST(Compaction, NodeRef) {
+  ast::ASTContext ctx;
+  auto &literals = ctx.pool<ast::IntegerLiteralExpr>();
+  auto *garbage = ctx.create<ast::IntegerLiteralExpr>(0);
+  auto *literal = ctx.create<ast::IntegerLiteralExpr>(42);
+  ctx.destroy(garbage);
+  Holder holder{literal, ast::NodeRef<ast::Expr>{literal}};
+  ASSERT_EQ(holder.ref.index(), 1);
+
+  ast::detail::Compactor compactor{ctx};
+  compactor.begin();
+  compactor.redirect(holder);
+  compactor.finish();
+
+  ASSERT_EQ(literals.num_slots(), 1);
+  EXPECT_EQ(holder.ptr, &literals.at(0));
+  EXPECT_EQ(holder.ref.ordinal(), ast::kNodeOrdinal<ast::IntegerLiteralExpr>);
+  EXPECT_EQ(holder.ref.index(), 0);
+  EXPECT_EQ(holder.ref.get(ctx), &literals.at(0));
+}
+
+// var x: i32; in one context, referred to from another.
+TEST(Compaction, UserInOtherContext) {
+  ast::ASTContext ctx;
+  ast::ASTContext other;
+  auto *garbage = ctx.create<ast::VarDecl>("garbage", nullptr);
+  auto *x = ctx.create<ast::VarDecl>("x", ctx.create<ast::IntegralType>(true, 32));
+  ctx.create<ast::CompilationUnitDecl>("_unit_")->decls.push_back(x);
+  ctx.destroy(garbage);
+  auto *ref = other.create<ast::DeclRefExpr>(x);
+
+  ast::compact_pools(ctx);
+
+  auto &new_x = ctx.pool<ast::VarDecl>().at(0);
+  EXPECT_EQ(new_x.name, "x");
+  ASSERT_EQ(new_x.users.size(), 1);
+  EXPECT_EQ(*new_x.users.begin(), static_cast<void *>(ref));
+}
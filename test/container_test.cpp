@@ -0,0 +1,194 @@
+#include "serde/container.h"
+
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <cstdint>
+#include <string>
+#include <utility>
+
+#include "serde/io.h"
+
+// Queues `encode` as the section for `class_id`, as `ASTSaver` does.
+template <typename F>
+void push(serde::BackgroundWriter &writer, int class_id, F &&encode) {
+  writer.push(class_id, writer.encode_section(std::forward<F>(encode)));
+}
+
+TEST(Container, Sections) {
+  const auto path = std::filesystem::path{testing::TempDir()} / "sections.snapshot";
+  std::filesystem::remove(path);
+  {
+    serde::BackgroundWriter writer{
+        std::make_unique<serde::SnapshotWriter>(path, serde::io::Format::kCompact, 2)};
+    push(writer, 7, [](serde::io::BufferedWriter &out) { serde::io::write_str(out, "a"); });
+    push(writer, 9, [](serde::io::BufferedWriter &out) { serde::io::write_u64(out, 300); });
+    EXPECT_FALSE(std::filesystem::exists(path));
+    writer.finish().get();
+  }
+  EXPECT_TRUE(std::filesystem::exists(path));
+  EXPECT_FALSE(std::filesystem::exists(path.string() + ".tmp"));
+
+  for (auto mode : {serde::LoadMode::kStream, serde::LoadMode::kMapped}) {
+    serde::SnapshotReader reader{path, mode};
+    EXPECT_EQ(reader.format(), serde::io::Format::kCompact);
+    ASSERT_EQ(reader.sections().size(), 2);
+    EXPECT_FALSE(reader.find(8));
+
+    // Read out of order: sections do not depend on each other.
+    const auto second = *reader.find(9);
+    EXPECT_EQ(second.offset % serde::kSectionAlignment, 0);
+    EXPECT_EQ(second.length, 2);
+    reader.read_section(second, [](serde::io::BufferedReader &in) {
+      EXPECT_EQ(serde::io::read_u64(in), 300);
+      EXPECT_TRUE(in.at_end());
+    });
+    reader.read_section(*reader.find(7), [](serde::io::BufferedReader &in) {
+      EXPECT_EQ(serde::io::read_str(in), "a");
+      EXPECT_TRUE(in.at_end());
+    });
+  }
+}
+
+TEST(Container, Compressed) {
+  const auto path = std::filesystem::path{testing::TempDir()} / "compressed.snapshot";
+  // Several blocks, some repetitive, some not.
+  std::string text;
+  for (int i = 0; i < 20000; i++)
+    text += "name_" + std::to_string(i % 100) + ';';
+  std::string noise(100000, '\0');
+  std::uint32_t x = 1;
+  for (auto &c : noise) {
+    x = x * 1664525 + 1013904223;
+    c = static_cast<char>(x >> 24);
+  }
+  {
+    serde::BackgroundWriter writer{std::make_unique<serde::SnapshotWriter>(
+        path, serde::io::Format::kFixed, 2, serde::CodecId::kLz)};
+    push(writer, 1, [&](serde::io::BufferedWriter &out) { serde::io::write_str(out, text); });
+    push(writer, 2, [&](serde::io::BufferedWriter &out) { serde::io::write_str(out, noise); });
+    writer.finish().get();
+  }
+
+  for (auto mode : {serde::LoadMode::kStream, serde::LoadMode::kMapped}) {
+    serde::SnapshotReader reader{path, mode};
+    EXPECT_EQ(reader.codec(), serde::CodecId::kLz);
+    const auto section = *reader.find(1);
+    EXPECT_EQ(section.raw_length, 8 + text.size());
+    EXPECT_LT(section.length * 4, section.raw_length);
+    reader.read_section(section, [&](serde::io::BufferedReader &in) {
+      EXPECT_EQ(serde::io::read_str(in), text);
+      EXPECT_TRUE(in.at_end());
+    });
+    reader.read_section(*reader.find(2), [&](serde::io::BufferedReader &in) {
+      EXPECT_EQ(serde::io::read_str(in), noise);
+    });
+  }
+}
+
+TEST(Container, EncodedAhead) {
+  const auto path = std::filesystem::path{testing::TempDir()} / "encoded.snapshot";
+  const std::string text(100000, 'z');
+  for (auto codec : {serde::CodecId::kNone, serde::CodecId::kLz}) {
+    std::filesystem::remove(path);
+    {
+      serde::SnapshotWriter writer{path, serde::io::Format::kCompact, 2, codec};
+      // Encoded out of order, before anything is written.
+      auto second = writer.encode_section(
+          [](serde::io::BufferedWriter &out) { serde::io::write_u64(out, 300); });
+      auto first = writer.encode_section(
+          [&](serde::io::BufferedWriter &out) { serde::io::write_str(out, text); });
+      EXPECT_EQ(first.raw_length, 3 + text.size());
+      writer.append_section(1, first);
+      writer.append_section(2, second);
+      writer.commit();
+    }
+    serde::SnapshotReader reader{path, serde::LoadMode::kMapped};
+    const auto first = *reader.find(1);
+    EXPECT_EQ(first.raw_length, 3 + text.size());
+    EXPECT_EQ(reader.find(2)->offset % serde::kSectionAlignment, 0);
+    reader.read_section(first, [&](serde::io::BufferedReader &in) {
+      EXPECT_EQ(serde::io::read_str(in), text);
+      EXPECT_TRUE(in.at_end());
+    });
+    reader.read_section(*reader.find(2), [](serde::io::BufferedReader &in) {
+      EXPECT_EQ(serde::io::read_u64(in), 300);
+      EXPECT_TRUE(in.at_end());
+    });
+  }
+}
+
+TEST(Container, Uncommitted) {
+  const auto path = std::filesystem::path{testing::TempDir()} / "uncommitted.snapshot";
+  std::filesystem::remove(path);
+  {
+    serde::SnapshotWriter writer{path, serde::io::Format::kFixed, 1};
+    writer.append_section(1, writer.encode_section([](serde::io::BufferedWriter &out) {
+      serde::io::write_u32(out, 1);
+    }));
+  }
+  EXPECT_FALSE(std::filesystem::exists(path));
+  EXPECT_FALSE(std::filesystem::exists(path.string() + ".tmp"));
+}
+
+TEST(Container, Background) {
+  const auto path = std::filesystem::path{testing::TempDir()} / "background.snapshot";
+  std::filesystem::remove(path);
+  bool committed = false;
+  std::future<void> done;
+  {
+    serde::BackgroundWriter writer{
+        std::make_unique<serde::SnapshotWriter>(path, serde::io::Format::kFixed, 3),
+        [&committed] { committed = true; }};
+    for (int id : {3, 1, 2}) {
+      writer.push(id, writer.encode_section(
+                          [id](serde::io::BufferedWriter &out) { serde::io::write_u32(out, id); }));
+    }
+    done = writer.finish();
+  }
+  done.get();
+  EXPECT_TRUE(committed);
+  serde::SnapshotReader reader{path, serde::LoadMode::kStream};
+  for (int id : {1, 2, 3}) {
+    reader.read_section(*reader.find(id), [id](serde::io::BufferedReader &in) {
+      EXPECT_EQ(serde::io::read_u32(in), id);
+    });
+  }
+
+  // Abandoned before `finish`.
+  std::filesystem::remove(path);
+  {
+    serde::BackgroundWriter writer{
+        std::make_unique<serde::SnapshotWriter>(path, serde::io::Format::kFixed, 1)};
+    writer.push(1, writer.encode_section(
+                       [](serde::io::BufferedWriter &out) { serde::io::write_u32(out, 1); }));
+  }
+  EXPECT_FALSE(std::filesystem::exists(path));
+  EXPECT_FALSE(std::filesystem::exists(path.string() + ".tmp"));
+}
+
+TEST(Container, NotASnapshot) {
+  const auto path = std::filesystem::path{testing::TempDir()} / "garbage.snapshot";
+  std::ofstream{path} << std::string(64, 'x');
+  EXPECT_THROW((serde::SnapshotReader{path, serde::LoadMode::kStream}), std::runtime_error);
+}
+
+TEST(Container, OtherByteOrder) {
+  const auto path = std::filesystem::path{testing::TempDir()} / "swapped.snapshot";
+  {
+    std::ofstream file{path, std::ios::binary};
+    const std::uint32_t magic = serde::kSwappedMagic;
+    file.write(reinterpret_cast<const char *>(&magic), sizeof(magic));
+    file << std::string(60, '\0');
+  }
+  try {
+    serde::SnapshotReader{path, serde::LoadMode::kStream};
+    FAIL() << "read a snapshot of the other byte order";
+  } catch (const std::runtime_error &e) {
+    EXPECT_NE(std::string{e.what()}.find("byte order"), std::string::npos);
+  }
+}
@@ -0,0 +1,167 @@
+#include "serde/io.h"
+
+#include <gtest/gtest.h>
+
+#include <climits>
+#include <cstdint>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+#include "ast/context.h"
+#include "ast/expr.h"
+#include "pool.h"
+#include "reflect/plain.h"
+#include "serde/decoder.h"
+#include "serde/encoder.h"
+#include "utility/save_restore.h"
+
+namespace {
+void write_sample(serde::io::BufferedWriter &out) {
+  serde::io::write_u32(out, 0xdeadbeef);
+  serde::io::write_str(out, "");
+  serde::io::write_str(out, std::string(100, 'x'));
+  serde::io::write_u64(out, 42);
+  serde::io::write_str(out, "hello");
+}
+
+void check_sample(serde::io::BufferedReader &in) {
+  EXPECT_EQ(serde::io::read_u32(in), 0xdeadbeef);
+  EXPECT_EQ(serde::io::read_str(in), "");
+  EXPECT_EQ(serde::io::read_str(in), std::string(100, 'x'));
+  EXPECT_EQ(serde::io::read_u64(in), 42);
+  EXPECT_EQ(serde::io::read_str(in), "hello");
+  EXPECT_TRUE(in.at_end());
+}
+}  // namespace
+
+TEST(BufferedIO, Roundtrip) {
+  // Tiny buffers so that values and strings straddle refills.
+  std::string bytes;
+  {
+    serde::io::BufferedWriter out{bytes, 7};
+    write_sample(out);
+    EXPECT_EQ(out.position(), 4 + 8 + 8 + 100 + 8 + 8 + 5);
+  }
+  EXPECT_EQ(bytes.size(), 141);
+
+  serde::io::BufferedReader from_memory{bytes.data(), bytes.size()};
+  check_sample(from_memory);
+
+  std::istringstream ss{bytes};
+  serde::io::BufferedReader from_stream{ss, 5};
+  check_sample(from_stream);
+  EXPECT_EQ(from_stream.position(), bytes.size());
+
+  serde::io::BufferedReader truncated{bytes.data(), 10};
+  serde::io::read_u32(truncated);
+  EXPECT_THROW(serde::io::read_u64(truncated), std::runtime_error);
+}
+
+TEST(BufferedIO, SameBytesAsStream) {
+  auto *node =
+      ast::Pool<ast::BinaryExpr>::instance().create(ast::BinaryExpr::kSub, nullptr, nullptr);
+
+  std::ostringstream ss;
+  serde::detail::DataEncoder<ast::BinaryExpr>{}(ss, *node);
+  std::string bytes;
+  {
+    serde::io::BufferedWriter out{bytes};
+    serde::detail::DataEncoder<ast::BinaryExpr>{}(out, *node);
+  }
+  EXPECT_EQ(bytes, ss.str());
+
+  serde::io::BufferedReader in{bytes.data(), bytes.size()};
+  ast::BinaryExpr loaded;
+  serde::detail::LoadState state;
+  SAVE_RESTORE(serde::detail::load_state, &state);
+  serde::detail::DataDecoder<ast::BinaryExpr>{}(in, loaded);
+  EXPECT_EQ(loaded.op, ast::BinaryExpr::kSub);
+  EXPECT_TRUE(in.at_end());
+}
+
+TEST(BufferedIO, BorrowedStrings) {
+  using Fields = std::tuple<std::string_view, std::string>;
+  std::string bytes;
+  {
+    serde::io::BufferedWriter out{bytes};
+    serde::detail::DataEncoder<Fields>{}(out, Fields{"borrowed", "copied"});
+  }
+
+  serde::detail::LoadState state;
+  SAVE_RESTORE(serde::detail::load_state, &state);
+
+  // In-memory input is stable: the view points into it.
+  Fields fields;
+  serde::io::BufferedReader in{bytes.data(), bytes.size()};
+  serde::detail::DataDecoder<Fields>{}(in, fields);
+  EXPECT_EQ(std::get<0>(fields), "borrowed");
+  EXPECT_GE(std::get<0>(fields).data(), bytes.data());
+  EXPECT_LT(std::get<0>(fields).data(), bytes.data() + bytes.size());
+  EXPECT_EQ(std::get<1>(fields), "copied");
+  EXPECT_TRUE(state.borrowed);
+
+  // A stream reader reuses its buffer, so the characters go to the loader's string arena.
+  std::istringstream ss{bytes};
+  serde::io::BufferedReader from_stream{ss};
+  serde::detail::DataDecoder<Fields>{}(from_stream, fields);
+  EXPECT_EQ(std::get<0>(fields), "borrowed");
+  ASSERT_EQ(state.owned_strings.size(), 1);
+  EXPECT_EQ(std::get<0>(fields).data(), state.owned_strings.front().data());
+}
+
+TEST(BufferedIO, Compact) {
+  const std::vector<std::uint64_t> unsigned_values{0, 1, 127, 128, 300, 1ull << 35, ~0ull};
+  const std::vector<std::int32_t> signed_values{0, -1, 1, -64, 63, INT32_MIN, INT32_MAX};
+
+  std::string bytes;
+  {
+    // A small buffer so that varints straddle refills.
+    serde::io::BufferedWriter out{bytes, 11};
+    out.set_format(serde::io::Format::kCompact);
+    for (auto x : unsigned_values)
+      serde::io::write_u64(out, x);
+    for (auto x : signed_values)
+      serde::io::detail::write(out, x);
+    serde::io::write_str(out, "abc");
+  }
+  // 1 + 1 + 1 + 2 + 2 + 6 + 10, 1 * 5 + 5 + 5, and 1 + 3.
+  EXPECT_EQ(bytes.size(), 23 + 15 + 4);
+
+  std::istringstream ss{bytes};
+  for (auto &in : {std::make_unique<serde::io::BufferedReader>(bytes.data(), bytes.size()),
+                   std::make_unique<serde::io::BufferedReader>(ss, 3)}) {
+    in->set_format(serde::io::Format::kCompact);
+    for (auto x : unsigned_values)
+      EXPECT_EQ(serde::io::read_u64(*in), x);
+    for (auto x : signed_values)
+      EXPECT_EQ(serde::io::detail::read<std::int32_t>(*in), x);
+    EXPECT_EQ(serde::io::read_str(*in), "abc");
+    EXPECT_TRUE(in->at_end());
+  }
+}
+
+TEST(BufferedIO, PlainData) {
+  static_assert(reflect::is_plain_node_v<ast::IntegerLiteralExpr>);
+  static_assert(!reflect::is_plain_node_v<ast::BinaryExpr>);
+  using Plain = reflect::PlainNode<ast::IntegerLiteralExpr>;
+  static_assert(Plain::kSize == sizeof(ast::IntegerLiteralExpr::value));
+
+  // The bytes of a plain node are what the fixed format writes for it.
+  const ast::IntegerLiteralExpr literal{7};
+  char copied[Plain::kSize];
+  Plain::save(literal, copied);
+  std::string bytes;
+  {
+    serde::io::BufferedWriter out{bytes};
+    serde::detail::DataEncoder<ast::IntegerLiteralExpr>{}(out, literal);
+  }
+  EXPECT_EQ(bytes, std::string(copied, Plain::kSize));
+  ast::IntegerLiteralExpr loaded{0};
+  Plain::load(bytes.data(), loaded);
+  EXPECT_EQ(loaded.value, 7);
+}
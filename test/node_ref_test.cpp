@@ -0,0 +1,46 @@
+#include "ast/node_ref.h"
+
+#include <gtest/gtest.h>
+
+#include <sstream>
+
+#include "ast/context.h"
+#include "ast/expr.h"
+#include "pool.h"
+#include "serde/decoder.h"
+#include "serde/encoder.h"
+
+TEST(NodeRef, Basic) {
+  static_assert(sizeof(ast::NodeRef<ast::Expr>) == 4);
+
+  auto &pool = ast::Pool<ast::BinaryExpr>::instance();
+  pool.clear();
+  pool.create();
+  auto *node = pool.create(ast::BinaryExpr::kAdd, nullptr, nullptr);
+
+  auto ref = ast::make_ref(node);
+  EXPECT_EQ(ref.ordinal(), ast::kNodeOrdinal<ast::BinaryExpr>);
+  EXPECT_EQ(ref.index(), 1);
+  EXPECT_EQ(ref.get(), node);
+
+  // Upcasts keep the same bits; a base ref finds the pool from the class ordinal.
+  ast::NodeRef<ast::Expr> base = ref;
+  EXPECT_EQ(base.raw(), ref.raw());
+  EXPECT_EQ(base.get(), node);
+  EXPECT_EQ(ast::NodeRef<ast::Expr>{static_cast<ast::Expr *>(node)}, base);
+
+  EXPECT_FALSE(ast::NodeRef<ast::Expr>{});
+  EXPECT_EQ(ast::NodeRef<ast::Expr>{nullptr}.get(), nullptr);
+}
+
+TEST(NodeRef, Serialization) {
+  auto *node = ast::Pool<ast::DeclRefExpr>::instance().create("x");
+  auto ref = ast::NodeRef<ast::Expr>{node};
+
+  std::stringstream ss;
+  serde::detail::DataEncoder<ast::NodeRef<ast::Expr>>{}(ss, ref);
+  ast::NodeRef<ast::Expr> loaded;
+  serde::detail::DataDecoder<ast::NodeRef<ast::Expr>>{}(ss, loaded);
+  EXPECT_EQ(loaded, ref);
+  EXPECT_EQ(loaded.get(), node);
+}
@@ -0,0 +1,300 @@
+#include "pool.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "ast/context.h"
+#include "ast/decl.h"
+#include "ast/expr.h"
+#include "columnar_pool.h"
+#include "pool_stats.h"
+
+TEST(Pool, Basic) {
+  auto &pool = ast::Pool<ast::IntegerLiteralExpr>::instance();
+  pool.clear();
+
+  std::vector<ast::IntegerLiteralExpr *> nodes;
+  for (std::uint64_t i = 0; i < 1000; i++) {
+    nodes.push_back(pool.create(i));
+  }
+  ASSERT_EQ(pool.num_nodes(), 1000);
+
+  // Addresses are stable across chunk growth and `at` is O(1) slot lookup.
+  for (std::size_t i = 0; i < nodes.size(); i++) {
+    EXPECT_EQ(&pool.at(i), nodes[i]);
+    EXPECT_EQ(pool.index_of(nodes[i]), i);
+    EXPECT_EQ(nodes[i]->value, i);
+  }
+}
+
+TEST(Pool, Destroy) {
+  auto &pool = ast::Pool<ast::IntegerLiteralExpr>::instance();
+  pool.clear();
+
+  std::vector<ast::IntegerLiteralExpr *> nodes;
+  for (std::uint64_t i = 0; i < 10; i++) {
+    nodes.push_back(pool.create(i));
+  }
+  pool.destroy(nodes[3]);
+  pool.destroy(nodes[7]);
+  EXPECT_EQ(pool.num_nodes(), 8);
+
+  std::vector<std::size_t> visited;
+  pool.for_each([&](std::size_t i, ast::IntegerLiteralExpr &node) {
+    EXPECT_EQ(node.value, i);
+    visited.push_back(i);
+  });
+  EXPECT_EQ(visited, (std::vector<std::size_t>{0, 1, 2, 4, 5, 6, 8, 9}));
+
+  pool.clear();
+  EXPECT_EQ(pool.num_nodes(), 0);
+  EXPECT_EQ(pool.num_slots(), 0);
+}
+
+TEST(Pool, Recycle) {
+  auto &pool = ast::Pool<ast::IntegerLiteralExpr>::instance();
+  pool.clear();
+
+  auto *a = pool.create(1);
+  auto *b = pool.create(2);
+  auto h = pool.handle_of(a);
+  EXPECT_EQ(pool.get(h), a);
+
+  pool.destroy(a);
+  EXPECT_EQ(pool.get(h), nullptr);
+
+  // The freed slot is reused, but the old handle stays stale.
+  auto *c = pool.create(3);
+  EXPECT_EQ(c, a);
+  EXPECT_EQ(pool.num_slots(), 2);
+  EXPECT_EQ(pool.get(h), nullptr);
+  EXPECT_NE(pool.handle_of(c), h);
+  EXPECT_EQ(pool.get(pool.handle_of(c))->value, 3);
+  EXPECT_EQ(pool.get(pool.handle_of(b))->value, 2);
+}
+
+TEST(Pool, Magazine) {
+  using Pool = ast::Pool<ast::IntegerLiteralExpr>;
+  auto &pool = Pool::instance();
+  pool.clear();
+
+  constexpr std::size_t kThreads = 4;
+  constexpr std::size_t kNodesPerThread = 10000;
+  std::vector<std::thread> threads;
+  for (std::size_t t = 0; t < kThreads; t++) {
+    threads.emplace_back([&pool, t] {
+      Pool::Magazine magazine{pool};
+      for (std::size_t i = 0; i < kNodesPerThread; i++) {
+        magazine.create(t * kNodesPerThread + i);
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  ASSERT_EQ(pool.num_nodes(), kThreads * kNodesPerThread);
+  std::vector<bool> seen(kThreads * kNodesPerThread);
+  pool.for_each([&seen](std::size_t, ast::IntegerLiteralExpr &node) { seen[node.value] = true; });
+  EXPECT_EQ(std::count(seen.begin(), seen.end(), true), seen.size());
+
+  // Unused reserved slots went back to the free list.
+  auto *node = pool.create(0);
+  EXPECT_LT(pool.index_of(node), pool.num_slots() - 1);
+}
+
+TEST(Pool, Allocate) {
+  auto &pool = ast::Pool<ast::IntegerLiteralExpr>::instance();
+  pool.clear();
+
+  const std::size_t first = pool.allocate(100);
+  EXPECT_EQ(first, 0);
+  EXPECT_EQ(pool.num_slots(), 100);
+  EXPECT_EQ(pool.num_nodes(), 0);
+
+  // Slots not constructed yet are invisible to `for_each`.
+  for (std::size_t i = 0; i < 100; i += 2) {
+    pool.construct_at(first + i, i);
+  }
+  EXPECT_EQ(pool.num_nodes(), 50);
+  pool.for_each([](std::size_t i, ast::IntegerLiteralExpr &node) {
+    EXPECT_EQ(i % 2, 0);
+    EXPECT_EQ(node.value, i);
+  });
+}
+
+TEST(Pool, Dirty) {
+  auto &pool = ast::Pool<ast::IntegerLiteralExpr>::instance();
+  pool.clear();
+
+  auto *a = pool.create(1);
+  auto *b = pool.create(2);
+  auto *c = pool.create(3);
+  EXPECT_TRUE(pool.all_dirty());
+  EXPECT_EQ(pool.num_dirty(), 3);
+
+  pool.clear_dirty();
+  EXPECT_FALSE(pool.all_dirty());
+  EXPECT_EQ(pool.num_dirty(), 0);
+
+  b->value = 20;
+  pool.mark_dirty(b);
+  pool.mark_dirty(b);
+  pool.destroy(c);
+  auto *d = pool.create(4);
+  auto *e = pool.create(5);
+  std::vector<std::size_t> dirty;
+  pool.for_each_dirty([&dirty](std::size_t i) { dirty.push_back(i); });
+  std::sort(dirty.begin(), dirty.end());
+  // `d` took the slot of `c`.
+  EXPECT_EQ(dirty, (std::vector<std::size_t>{pool.index_of(b), pool.index_of(d),
+                                             pool.index_of(e)}));
+
+  pool.clear_dirty();
+  EXPECT_EQ(pool.num_dirty(), 0);
+  pool.mark_dirty(a);
+  EXPECT_EQ(pool.num_dirty(), 1);
+
+  pool.clear();
+  EXPECT_TRUE(pool.all_dirty());
+}
+
+TEST(ColumnarPool, Basic) {
+  using Pool = ast::ColumnarPool<ast::BinaryExpr>;
+  static_assert(Pool::kNumColumns == 3);
+  static_assert(Pool::kColumnOf<&ast::BinaryExpr::rhs> == 2);
+
+  Pool pool;
+  auto *a = ast::Pool<ast::IntegerLiteralExpr>::instance().create(1);
+  auto *b = ast::Pool<ast::IntegerLiteralExpr>::instance().create(2);
+  pool.emplace(ast::BinaryExpr::kAdd, a, b);
+  pool.push_back(ast::BinaryExpr{ast::BinaryExpr::kSub, b, a});
+  ASSERT_EQ(pool.size(), 2);
+
+  // One field of every node is one contiguous column.
+  const auto &ops = pool.column<&ast::BinaryExpr::op>();
+  EXPECT_EQ(ops, (std::vector{ast::BinaryExpr::kAdd, ast::BinaryExpr::kSub}));
+
+  auto row = pool[1];
+  EXPECT_EQ(row.get<&ast::BinaryExpr::lhs>(), b);
+  row.get<&ast::BinaryExpr::op>() = ast::BinaryExpr::kNotEqual;
+  auto node = row.load();
+  EXPECT_EQ(node.kind, ast::Expr::Kind::kBinaryExpr);
+  EXPECT_EQ(node.op, ast::BinaryExpr::kNotEqual);
+  EXPECT_EQ(node.rhs, a);
+}
+
+TEST(ColumnarPool, InheritedFields) {
+  using Pool = ast::ColumnarPool<ast::VarDecl>;
+  // `name` comes from `Decl`; its transient `users` has no column.
+  static_assert(Pool::kNumColumns == 3);
+  static_assert(Pool::kColumnOf<&ast::VarDecl::name> == 0);
+
+  Pool pool;
+  pool.emplace("x", nullptr);
+  EXPECT_EQ(pool[0].get<&ast::Decl::name>(), "x");
+  EXPECT_EQ(pool[0].load().name, "x");
+}
+
+TEST(ColumnarPool, Users) {
+  ast::ASTContext ctx;
+  auto *x = ctx.create<ast::VarDecl>("x", nullptr);
+  ast::ColumnarPool<ast::DeclRefExpr> pool;
+  pool.emplace(x);
+  pool.push_back(ast::DeclRefExpr{"y"});
+
+  // Rows are not nodes, so the declaration does not count them as users.
+  EXPECT_TRUE(x->users.empty());
+  EXPECT_EQ(pool[0].load().decl, x);
+  EXPECT_EQ(pool[1].load().decl, nullptr);
+  EXPECT_EQ(pool[1].load().name, "y");
+  EXPECT_TRUE(x->users.empty());
+}
+
+TEST(Pool, Stats) {
+  auto &pool = ast::Pool<ast::StringLiteralExpr>::instance();
+  pool.clear();
+  EXPECT_EQ(pool.stats().bytes_reserved, 0);
+
+  const std::string long_value(100, 'x');
+  auto *a = pool.create("short");
+  pool.create(long_value);
+  pool.destroy(a);
+
+  auto stats = pool.stats();
+  EXPECT_EQ(stats.num_nodes, 1);
+  EXPECT_EQ(stats.num_slots, 2);
+  EXPECT_EQ(stats.capacity, ast::Pool<ast::StringLiteralExpr>::kFirstChunkSize);
+  EXPECT_GE(stats.bytes_reserved, stats.capacity * sizeof(ast::StringLiteralExpr));
+  EXPECT_EQ(stats.bytes_used, sizeof(ast::StringLiteralExpr));
+  EXPECT_GE(stats.heap_bytes, long_value.size());
+  EXPECT_DOUBLE_EQ(stats.fragmentation(), 0.5);
+
+  auto all = ast::collect_pool_stats();
+  ASSERT_EQ(all.size(), std::tuple_size_v<ast::Nodes> - 1);
+  auto it = std::find_if(all.begin(), all.end(), [](const auto &x) {
+    return x.class_id == ast::StringLiteralExpr::kClassID;
+  });
+  ASSERT_NE(it, all.end());
+  EXPECT_EQ(it->class_name, "StringLiteralExpr");
+  EXPECT_EQ(it->stats.heap_bytes, stats.heap_bytes);
+  EXPECT_GE(ast::total(all).heap_bytes, stats.heap_bytes);
+
+  std::ostringstream ss;
+  ast::print_pool_stats(ss, all);
+  EXPECT_NE(ss.str().find("StringLiteralExpr"), std::string::npos);
+}
+
+TEST(Pool, ParallelForEach) {
+  auto &pool = ast::Pool<ast::IntegerLiteralExpr>::instance();
+  pool.clear();
+
+  constexpr std::uint64_t kNodes = 100000;
+  std::vector<ast::IntegerLiteralExpr *> nodes;
+  for (std::uint64_t i = 0; i < kNodes; i++) {
+    nodes.push_back(pool.create(i));
+  }
+  for (std::uint64_t i = 0; i < kNodes; i += 7) {
+    pool.destroy(nodes[i]);
+  }
+
+  std::uint64_t expected = 0;
+  pool.for_each([&expected](std::size_t, const ast::IntegerLiteralExpr &node) {
+    expected += node.value;
+  });
+
+  std::atomic<std::uint64_t> sum{0};
+  std::atomic<std::size_t> count{0};
+  pool.parallel_for_each(
+      [&](std::size_t i, const ast::IntegerLiteralExpr &node) {
+        EXPECT_EQ(node.value, i);
+        sum += node.value;
+        count++;
+      },
+      1000);
+  EXPECT_EQ(sum, expected);
+  EXPECT_EQ(count, pool.num_nodes());
+
+  std::uint64_t prefetched = 0;
+  pool.for_each_prefetch([&prefetched](std::size_t, const ast::IntegerLiteralExpr &node) {
+    prefetched += node.value;
+  });
+  EXPECT_EQ(prefetched, expected);
+
+  prefetched = 0;
+  pool.for_each_prefetch(
+      [&prefetched](std::size_t, const ast::IntegerLiteralExpr &node) { prefetched += node.value; },
+      4);
+  EXPECT_EQ(prefetched, expected);
+
+  std::size_t num_ahead = 0;
+  pool.for_each_prefetch([](std::size_t, const ast::IntegerLiteralExpr &) {},
+                         [&num_ahead](const ast::IntegerLiteralExpr &) { num_ahead++; }, 1);
+  EXPECT_GT(num_ahead, 0);
+  EXPECT_LT(num_ahead, pool.num_nodes());
+}
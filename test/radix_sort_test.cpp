@@ -0,0 +1,29 @@
+#include "utility/radix_sort.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+TEST(RadixSort, Stable) {
+  std::vector<std::pair<std::uint64_t, int>> items;
+  std::uint32_t x = 1;
+  for (int i = 0; i < 10000; i++) {
+    x = x * 1664525 + 1013904223;
+    // Few distinct keys, spread over the high and low halves.
+    items.emplace_back(std::uint64_t{x >> 29} << 32 | (x >> 20 & 3), i);
+  }
+  auto expected = items;
+  std::stable_sort(expected.begin(), expected.end(),
+                   [](const auto &a, const auto &b) { return a.first < b.first; });
+  utility::radix_sort(items, [](const auto &item) { return item.first; });
+  EXPECT_EQ(items, expected);
+}
+
+TEST(RadixSort, SameKeys) {
+  std::vector<std::uint32_t> items{7, 7, 7};
+  utility::radix_sort(items, [](std::uint32_t v) { return v; });
+  EXPECT_EQ(items, (std::vector<std::uint32_t>{7, 7, 7}));
+}
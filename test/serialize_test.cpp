@@ -2,15 +2,43 @@
 
 #include <gtest/gtest.h>
 
+#include <cstdint>
+#include <filesystem>
 #include <iostream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <tuple>
 #include <vector>
 
 #include "ast/api/pretty_print.h"
+#include "ast/compact.h"
+#include "ast/context.h"
 #include "ast/decl.h"
 #include "ast/expr.h"
 #include "ast/type.h"
 #include "pool.h"
+#include "serde/container.h"
 #include "serde/deserialize.h"
+#include "serde/size.h"
+
+namespace {
+// var x: i32;
+// func f0() -> i32 { x + 0 }  ...  func f<n - 1>() -> i32 { x + <n - 1> }
+ast::CompilationUnitDecl *build_funcs(ast::ASTContext &ctx, int num_funcs) {
+  auto i32 = ctx.create<ast::IntegralType>(true, 32);
+  auto x = ctx.create<ast::VarDecl>("x", i32);
+  auto cu = ctx.create<ast::CompilationUnitDecl>("_unit_");
+  for (int i = 0; i < num_funcs; i++) {
+    auto body = ctx.create<ast::BlockExpr>(ctx.create<ast::BinaryExpr>(
+        ast::BinaryExpr::OpCode::kAdd, ctx.create<ast::DeclRefExpr>(x),
+        ctx.create<ast::IntegerLiteralExpr>(i)));
+    cu->decls.push_back(ctx.create<ast::FuncDecl>(
+        "f" + std::to_string(i), std::vector<ast::FuncDecl::ParamSpec>{}, i32, body));
+  }
+  return cu;
+}
+}  // namespace
 
 TEST(Serialization, It_Compiles) {
   serde::ASTSaver saver{"."};
@@ -66,3 +94,561 @@ TEST(Deserialization, Basic) {
             "  a + b\n"
             "}");
 }
+
+TEST(Serialization, IndependentContexts) {
+  auto dir = std::filesystem::path{testing::TempDir()} / "contexts";
+  std::filesystem::create_directories(dir);
+
+  {
+    ast::ASTContext ctx;
+    build_funcs(ctx, 1);
+
+    serde::ASTSaver saver{ctx, dir};
+    saver.save();
+  }
+
+  ast::ASTContext ctx;
+  serde::ASTLoader loader{ctx, dir};
+  loader.load();
+
+  ASSERT_EQ(ctx.pool<ast::CompilationUnitDecl>().num_nodes(), 1);
+  EXPECT_EQ(ast::to_string(ctx.pool<ast::CompilationUnitDecl>().at(0)),
+            "func f0() -> i32 {\n"
+            "  x + 0\n"
+            "}");
+  // The global context is untouched.
+  EXPECT_EQ(ast::Pool<ast::IntegerLiteralExpr>::instance().num_nodes(), 0);
+}
+
+TEST(Deserialization, Mapped) {
+  auto dir = std::filesystem::path{testing::TempDir()} / "mapped";
+  std::filesystem::create_directories(dir);
+
+  {
+    ast::ASTContext ctx;
+    build_funcs(ctx, 1);
+
+    serde::ASTSaver saver{ctx, dir};
+    saver.save();
+  }
+
+  ast::ASTContext streamed;
+  serde::ASTLoader{streamed, dir}.load();
+  ast::ASTContext mapped;
+  serde::ASTLoader{mapped, dir, serde::LoadMode::kMapped}.load();
+
+  ASSERT_EQ(mapped.pool<ast::CompilationUnitDecl>().num_nodes(), 1);
+  EXPECT_EQ(ast::to_string(mapped.pool<ast::CompilationUnitDecl>().at(0)),
+            ast::to_string(streamed.pool<ast::CompilationUnitDecl>().at(0)));
+  EXPECT_EQ(mapped.pool<ast::FuncDecl>().at(0).users.size(), 1);
+}
+
+TEST(Serialization, Compact) {
+  auto fixed_dir = std::filesystem::path{testing::TempDir()} / "fixed";
+  auto compact_dir = std::filesystem::path{testing::TempDir()} / "compact";
+  std::filesystem::create_directories(fixed_dir);
+  auto lz_dir = std::filesystem::path{testing::TempDir()} / "lz";
+  std::filesystem::create_directories(compact_dir);
+  std::filesystem::create_directories(lz_dir);
+
+  {
+    ast::ASTContext ctx;
+    build_funcs(ctx, 1);
+    // Big enough to take more than one byte as a varint.
+    ctx.pool<ast::IntegerLiteralExpr>().at(0).value = 1000;
+
+    serde::ASTSaver{ctx, fixed_dir}.save();
+    serde::ASTSaver{ctx, compact_dir, serde::io::Format::kCompact}.save();
+    serde::ASTSaver{ctx, lz_dir, serde::io::Format::kCompact, serde::CodecId::kLz}.save();
+  }
+  auto section_length = [](const std::filesystem::path &dir) {
+    serde::SnapshotReader reader{serde::snapshot_path(dir), serde::LoadMode::kStream};
+    return reader.find(ast::FuncDecl::kClassID)->length;
+  };
+  EXPECT_LT(section_length(compact_dir), section_length(fixed_dir));
+
+  for (const auto &dir : {compact_dir, lz_dir}) {
+    ast::ASTContext ctx;
+    serde::ASTLoader{ctx, dir}.load();
+    ASSERT_EQ(ctx.pool<ast::CompilationUnitDecl>().num_nodes(), 1);
+    EXPECT_EQ(ast::to_string(ctx.pool<ast::CompilationUnitDecl>().at(0)),
+              "func f0() -> i32 {\n"
+              "  x + 1000\n"
+              "}");
+  }
+}
+
+TEST(Serialization, KeepsSlotIndices) {
+  auto dir = std::filesystem::path{testing::TempDir()} / "slots";
+  std::filesystem::create_directories(dir);
+
+  {
+    ast::ASTContext ctx;
+    auto i32 = ctx.create<ast::IntegralType>(true, 32);
+    auto doomed = ctx.create<ast::IntegerLiteralExpr>(1);
+    auto body = ctx.create<ast::BlockExpr>(ctx.create<ast::IntegerLiteralExpr>(2));
+    ctx.destroy(doomed);
+    auto fn = ctx.create<ast::FuncDecl>("two", std::vector<ast::FuncDecl::ParamSpec>{}, i32,
+                                        body);
+    ctx.create<ast::CompilationUnitDecl>("_unit_")->decls.push_back(fn);
+    serde::ASTSaver{ctx, dir}.save();
+  }
+
+  ast::ASTContext ctx;
+  serde::ASTLoader{ctx, dir}.load();
+  auto &literals = ctx.pool<ast::IntegerLiteralExpr>();
+  EXPECT_EQ(literals.num_slots(), 2);
+  ASSERT_EQ(literals.num_nodes(), 1);
+  EXPECT_EQ(literals.at(1).value, 2);
+  EXPECT_EQ(ast::to_string(ctx.pool<ast::CompilationUnitDecl>().at(0)),
+            "func two() -> i32 {\n"
+            "  2\n"
+            "}");
+  // The hole is free again.
+  EXPECT_EQ(literals.index_of(literals.create(3)), 0);
+}
+
+TEST(Serialization, StringTable) {
+  auto dir = std::filesystem::path{testing::TempDir()} / "strings";
+  std::filesystem::create_directories(dir);
+
+  {
+    ast::ASTContext ctx;
+    auto i32 = ctx.create<ast::IntegralType>(true, 32);
+    for (int i = 0; i < 100; i++) {
+      ctx.create<ast::VarDecl>(i % 2 ? "some_long_identifier" : "another_long_identifier", i32);
+      ctx.create<ast::DeclRefExpr>("some_long_identifier");
+    }
+    ctx.create<ast::ClassType>("another_long_identifier");
+    serde::ASTSaver{ctx, dir}.save();
+  }
+
+  serde::SnapshotReader reader{serde::snapshot_path(dir), serde::LoadMode::kStream};
+  reader.read_section(*reader.find(serde::kStringTableSection),
+                      [](serde::io::BufferedReader &in) { EXPECT_EQ(serde::io::read_u32(in), 2); });
+  // Less than the characters of the names alone.
+  EXPECT_LT(reader.find(ast::DeclRefExpr::kClassID)->length, 100 * 20);
+
+  for (auto mode : {serde::LoadMode::kStream, serde::LoadMode::kMapped}) {
+    ast::ASTContext ctx;
+    serde::ASTLoader{ctx, dir, mode}.load();
+    auto &vars = ctx.pool<ast::VarDecl>();
+    ASSERT_EQ(vars.num_nodes(), 100);
+    EXPECT_EQ(vars.at(0).name, "another_long_identifier");
+    EXPECT_EQ(vars.at(1).name, "some_long_identifier");
+    EXPECT_EQ(ctx.pool<ast::DeclRefExpr>().at(99).name, "some_long_identifier");
+    EXPECT_EQ(ctx.pool<ast::ClassType>().at(0).name, "another_long_identifier");
+  }
+}
+
+TEST(Deserialization, Users) {
+  auto dir = std::filesystem::path{testing::TempDir()} / "users";
+  std::filesystem::create_directories(dir);
+
+  constexpr int kNumVars = 10;
+  constexpr int kNumRefs = 50000;
+  {
+    ast::ASTContext ctx;
+    auto i32 = ctx.create<ast::IntegralType>(true, 32);
+    std::vector<ast::VarDecl *> vars;
+    for (int i = 0; i < kNumVars; i++)
+      vars.push_back(ctx.create<ast::VarDecl>("v" + std::to_string(i), i32));
+    // More relocations than one task patches, all pointing at a few declarations.
+    for (int i = 0; i < kNumRefs; i++)
+      ctx.create<ast::DeclRefExpr>(vars[i % kNumVars]);
+    serde::ASTSaver{ctx, dir}.save();
+  }
+
+  ast::ASTContext ctx;
+  serde::ASTLoader{ctx, dir}.load();
+  auto &vars = ctx.pool<ast::VarDecl>();
+  auto &refs = ctx.pool<ast::DeclRefExpr>();
+  ASSERT_EQ(refs.num_nodes(), kNumRefs);
+  for (int i = 0; i < kNumVars; i++) {
+    EXPECT_EQ(vars.at(i).users.size(), kNumRefs / kNumVars);
+    EXPECT_TRUE(vars.at(i).users.count(&refs.at(i)));
+  }
+  EXPECT_EQ(refs.at(kNumRefs - 1).decl, &vars.at(kNumVars - 1));
+}
+
+TEST(Deserialization, Lazy) {
+  auto plain_dir = std::filesystem::path{testing::TempDir()} / "lazy";
+  auto lz_dir = std::filesystem::path{testing::TempDir()} / "lazy_lz";
+  std::filesystem::create_directories(plain_dir);
+  std::filesystem::create_directories(lz_dir);
+
+  {
+    ast::ASTContext ctx;
+    build_funcs(ctx, 3);
+    serde::ASTSaver{ctx, plain_dir}.save();
+    serde::ASTSaver{ctx, lz_dir, serde::io::Format::kCompact, serde::CodecId::kLz}.save();
+  }
+
+  for (const auto &dir : {plain_dir, lz_dir}) {
+    ast::ASTContext ctx;
+    serde::ASTLoader{ctx, dir, serde::LoadMode::kLazy}.load();
+    auto &funcs = ctx.pool<ast::FuncDecl>();
+    auto &blocks = ctx.pool<ast::BlockExpr>();
+    auto &literals = ctx.pool<ast::IntegerLiteralExpr>();
+    auto &x = ctx.pool<ast::VarDecl>().at(0);
+    ASSERT_EQ(funcs.num_nodes(), 3);
+    EXPECT_EQ(funcs.at(1).name, "f1");
+    EXPECT_EQ(blocks.num_nodes(), 0);
+    EXPECT_EQ(literals.num_nodes(), 0);
+    EXPECT_TRUE(x.users.empty());
+
+    // Only the nodes of that body are decoded.
+    auto *body = funcs.at(1).get_body();
+    ASSERT_NE(body, nullptr);
+    EXPECT_EQ(body, &blocks.at(1));
+    EXPECT_EQ(blocks.num_nodes(), 1);
+    ASSERT_EQ(literals.num_nodes(), 1);
+    EXPECT_EQ(literals.at(1).value, 1);
+    EXPECT_EQ(x.users.size(), 1);
+    EXPECT_EQ(funcs.at(1).get_body(), body);
+
+    ast::ASTContext eager;
+    serde::ASTLoader{eager, dir}.load();
+    EXPECT_EQ(ast::to_string(ctx.pool<ast::CompilationUnitDecl>().at(0)),
+              ast::to_string(eager.pool<ast::CompilationUnitDecl>().at(0)));
+    EXPECT_EQ(blocks.num_nodes(), 3);
+    EXPECT_EQ(x.users.size(), 3);
+  }
+}
+
+TEST(Deserialization, LazyResave) {
+  auto dir = std::filesystem::path{testing::TempDir()} / "lazy_resave";
+  std::filesystem::create_directories(dir);
+  {
+    ast::ASTContext ctx;
+    auto *x = ctx.create<ast::VarDecl>("x", nullptr);
+    build_funcs(ctx, 2)->decls.push_back(x);
+    // In no function body; `x` has them and the unit as users.
+    for (int i = 0; i < 5; i++)
+      ctx.create<ast::DeclRefExpr>(x);
+    serde::ASTSaver{ctx, dir}.save();
+  }
+
+  auto count_nodes = [](ast::ASTContext &ctx) {
+    return std::make_tuple(ctx.pool<ast::DeclRefExpr>().num_nodes(),
+                           ctx.pool<ast::BlockExpr>().num_nodes(),
+                           ctx.pool<ast::IntegerLiteralExpr>().num_nodes());
+  };
+  ast::ASTContext eager;
+  serde::ASTLoader{eager, dir}.load();
+  ASSERT_EQ(count_nodes(eager), std::make_tuple(7, 2, 2));
+  const auto &users = eager.pool<ast::VarDecl>().at(0).users;
+  ASSERT_EQ(users.size(), 5 + 1);
+
+  {
+    ast::ASTContext lazy;
+    serde::ASTLoader{lazy, dir, serde::LoadMode::kLazy}.load();
+    lazy.pool<ast::FuncDecl>().at(0).get_body();
+    serde::ASTSaver{lazy, dir}.save();
+  }
+  ast::ASTContext resaved;
+  serde::ASTLoader{resaved, dir}.load();
+  EXPECT_EQ(count_nodes(resaved), count_nodes(eager));
+  EXPECT_EQ(resaved.pool<ast::VarDecl>().at(0).users.size(), users.size());
+  EXPECT_EQ(ast::to_string(resaved.pool<ast::CompilationUnitDecl>().at(0)),
+            ast::to_string(eager.pool<ast::CompilationUnitDecl>().at(0)));
+
+  ast::ASTContext compacted;
+  serde::ASTLoader{compacted, dir, serde::LoadMode::kLazy}.load();
+  ast::compact_pools(compacted);
+  EXPECT_EQ(count_nodes(compacted), count_nodes(eager));
+  EXPECT_EQ(compacted.pool<ast::VarDecl>().at(0).users.size(), users.size());
+}
+
+TEST(Serialization, Delta) {
+  auto dir = std::filesystem::path{testing::TempDir()} / "delta";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  const auto snapshot = serde::snapshot_path(dir);
+
+  ast::ASTContext ctx;
+  auto i32 = ctx.create<ast::IntegralType>(true, 32);
+  auto x = ctx.create<ast::VarDecl>("x", i32);
+  auto y = ctx.create<ast::VarDecl>("y", i32);
+  std::vector<ast::IntegerLiteralExpr *> literals;
+  for (int i = 0; i < 10; i++)
+    literals.push_back(ctx.create<ast::IntegerLiteralExpr>(i));
+  auto ref = ctx.create<ast::DeclRefExpr>(x);
+  // Nothing saved yet, so this writes a full snapshot.
+  serde::ASTSaver{ctx, dir}.save_delta();
+  EXPECT_FALSE(std::filesystem::exists(serde::delta_path(snapshot, 1)));
+
+  // A node modified, one destroyed, one created in its slot, then one created past the end.
+  literals[3]->value = 30;
+  ctx.mark_dirty(literals[3]);
+  ctx.destroy(literals[5]);
+  ctx.create<ast::IntegerLiteralExpr>(50);
+  serde::ASTSaver{ctx, dir}.save_delta();
+  ASSERT_TRUE(std::filesystem::exists(serde::delta_path(snapshot, 1)));
+
+  ref->decl = y;
+  ctx.mark_dirty(ref);
+  ctx.destroy(literals[7]);
+  serde::ASTSaver{ctx, dir}.save_delta();
+  ASSERT_TRUE(std::filesystem::exists(serde::delta_path(snapshot, 2)));
+
+  auto check = [&ctx](ast::ASTContext &loaded) {
+    auto &pool = loaded.pool<ast::IntegerLiteralExpr>();
+    ASSERT_EQ(pool.num_slots(), ctx.pool<ast::IntegerLiteralExpr>().num_slots());
+    for (std::size_t i = 0; i < pool.num_slots(); i++) {
+      ASSERT_EQ(pool.is_live(i), ctx.pool<ast::IntegerLiteralExpr>().is_live(i));
+      if (pool.is_live(i)) {
+        EXPECT_EQ(pool.at(i).value, ctx.pool<ast::IntegerLiteralExpr>().at(i).value);
+      }
+    }
+    auto &vars = loaded.pool<ast::VarDecl>();
+    EXPECT_EQ(loaded.pool<ast::DeclRefExpr>().at(0).decl, &vars.at(1));
+    EXPECT_TRUE(vars.at(0).users.empty());
+    EXPECT_EQ(vars.at(1).users.size(), 1);
+    EXPECT_EQ(pool.num_dirty(), 0);
+  };
+  for (auto mode : {serde::LoadMode::kStream, serde::LoadMode::kMapped, serde::LoadMode::kLazy}) {
+    ast::ASTContext loaded;
+    serde::ASTLoader{loaded, dir, mode}.load();
+    check(loaded);
+  }
+
+  // A full save drops the deltas, and ones left over from an older snapshot are ignored.
+  std::filesystem::copy_file(serde::delta_path(snapshot, 1), dir / "stale");
+  serde::ASTSaver{ctx, dir}.save();
+  EXPECT_FALSE(std::filesystem::exists(serde::delta_path(snapshot, 1)));
+  std::filesystem::rename(dir / "stale", serde::delta_path(snapshot, 1));
+  ast::ASTContext loaded;
+  serde::ASTLoader{loaded, dir}.load();
+  check(loaded);
+}
+
+TEST(Serialization, DeltaOfOtherSnapshot) {
+  auto mine = std::filesystem::path{testing::TempDir()} / "delta_mine";
+  auto other = std::filesystem::path{testing::TempDir()} / "delta_other";
+  for (const auto &dir : {mine, other}) {
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+  }
+  auto make_literals = [](ast::ASTContext &ctx, int first) {
+    for (int i = 0; i < 10; i++)
+      ctx.create<ast::IntegerLiteralExpr>(first + i);
+  };
+  auto values = [](const std::filesystem::path &dir) {
+    ast::ASTContext loaded;
+    serde::ASTLoader{loaded, dir}.load();
+    std::vector<std::uint64_t> values;
+    loaded.pool<ast::IntegerLiteralExpr>().for_each(
+        [&values](std::size_t, const ast::IntegerLiteralExpr &node) {
+          values.push_back(node.value);
+        });
+    return values;
+  };
+
+  ast::ASTContext ctx;
+  make_literals(ctx, 0);
+  serde::ASTSaver{ctx, mine}.save();
+  ast::ASTContext other_ctx;
+  make_literals(other_ctx, 100);
+  serde::ASTSaver{other_ctx, other}.save();
+
+  // The changes since `mine` would be spliced into `other`, so this writes a full snapshot.
+  ctx.pool<ast::IntegerLiteralExpr>().at(0).value = 1;
+  ctx.mark_dirty(&ctx.pool<ast::IntegerLiteralExpr>().at(0));
+  serde::ASTSaver{ctx, other}.save_delta();
+  EXPECT_FALSE(std::filesystem::exists(serde::delta_path(serde::snapshot_path(other), 1)));
+  EXPECT_EQ(values(other), (std::vector<std::uint64_t>{1, 1, 2, 3, 4, 5, 6, 7, 8, 9}));
+
+  // Another context loaded from `other` too and added a delta since.
+  ast::ASTContext sibling;
+  serde::ASTLoader{sibling, other}.load();
+  sibling.pool<ast::IntegerLiteralExpr>().at(9).value = 90;
+  sibling.mark_dirty(&sibling.pool<ast::IntegerLiteralExpr>().at(9));
+  serde::ASTSaver{sibling, other}.save_delta();
+  ASSERT_TRUE(std::filesystem::exists(serde::delta_path(serde::snapshot_path(other), 1)));
+  ctx.pool<ast::IntegerLiteralExpr>().at(1).value = 10;
+  ctx.mark_dirty(&ctx.pool<ast::IntegerLiteralExpr>().at(1));
+  serde::ASTSaver{ctx, other}.save_delta();
+  EXPECT_FALSE(std::filesystem::exists(serde::delta_path(serde::snapshot_path(other), 1)));
+  EXPECT_EQ(values(other), (std::vector<std::uint64_t>{1, 10, 2, 3, 4, 5, 6, 7, 8, 9}));
+}
+
+TEST(Deserialization, MissingNode) {
+  auto dir = std::filesystem::path{testing::TempDir()} / "missing";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+
+  ast::ASTContext ctx;
+  std::vector<ast::IntegerLiteralExpr *> literals;
+  for (int i = 0; i < 10; i++)
+    literals.push_back(ctx.create<ast::IntegerLiteralExpr>(i));
+  ctx.create<ast::UnaryExpr>(ast::UnaryExpr::kNeg, literals[0]);
+  serde::ASTSaver{ctx, dir}.save();
+  // The delta frees the operand of the unchanged negation.
+  ctx.destroy(literals[0]);
+  serde::ASTSaver{ctx, dir}.save_delta();
+  ASSERT_TRUE(std::filesystem::exists(serde::delta_path(serde::snapshot_path(dir), 1)));
+
+  ast::ASTContext loaded;
+  EXPECT_THROW(serde::ASTLoader(loaded, dir).load(), std::runtime_error);
+}
+
+TEST(Serialization, Async) {
+  auto dir = std::filesystem::path{testing::TempDir()} / "async";
+  std::filesystem::create_directories(dir);
+
+  ast::ASTContext ctx;
+  auto *literal = ctx.create<ast::IntegerLiteralExpr>(1);
+  auto done = serde::ASTSaver{ctx, dir, serde::io::Format::kCompact, serde::CodecId::kLz}
+                  .save_async();
+  // Encoded already: the file gets the value from before.
+  literal->value = 2;
+  ctx.create<ast::IntegerLiteralExpr>(3);
+  done.get();
+
+  ast::ASTContext loaded;
+  serde::ASTLoader{loaded, dir}.load();
+  ASSERT_EQ(loaded.pool<ast::IntegerLiteralExpr>().num_nodes(), 1);
+  EXPECT_EQ(loaded.pool<ast::IntegerLiteralExpr>().at(0).value, 1);
+}
+
+TEST(Serialization, AsyncOrdering) {
+  auto dir = std::filesystem::path{testing::TempDir()} / "async_ordering";
+  // A full directory where the snapshot should go, so that renaming onto it fails.
+  auto blocked = std::filesystem::path{testing::TempDir()} / "async_blocked";
+  std::filesystem::remove_all(dir);
+  std::filesystem::remove_all(blocked);
+  std::filesystem::create_directories(dir);
+  std::filesystem::create_directories(blocked / serde::kSnapshotFileName / "file");
+  const auto first_delta = serde::delta_path(serde::snapshot_path(dir), 1);
+
+  ast::ASTContext ctx;
+  auto &literals = ctx.pool<ast::IntegerLiteralExpr>();
+  for (int i = 0; i < 10; i++)
+    ctx.create<ast::IntegerLiteralExpr>(i);
+  auto set = [&ctx, &literals](std::size_t i, std::uint64_t value) {
+    literals.at(i).value = value;
+    ctx.mark_dirty(&literals.at(i));
+  };
+
+  // The delta waits for the snapshot it goes on top of.
+  auto written = serde::ASTSaver{ctx, dir}.save_async();
+  set(1, 10);
+  serde::ASTSaver{ctx, dir}.save_delta();
+  written.get();
+  EXPECT_TRUE(std::filesystem::exists(first_delta));
+
+  // The changes that a failed save cleared are saved by the next one.
+  set(2, 20);
+  auto failed = serde::ASTSaver{ctx, blocked}.save_async();
+  EXPECT_THROW(failed.get(), std::system_error);
+  ctx.wait_for_save();
+  EXPECT_TRUE(literals.all_dirty());
+  EXPECT_FALSE(ctx.snapshot_state());
+  serde::ASTSaver{ctx, dir}.save_delta();
+  EXPECT_FALSE(std::filesystem::exists(first_delta));
+
+  ast::ASTContext loaded;
+  serde::ASTLoader{loaded, dir}.load();
+  EXPECT_EQ(loaded.pool<ast::IntegerLiteralExpr>().at(1).value, 10);
+  EXPECT_EQ(loaded.pool<ast::IntegerLiteralExpr>().at(2).value, 20);
+
+  // Loading waits for the save too; its failure does not touch the snapshot loaded after it.
+  failed = serde::ASTSaver{ctx, blocked}.save_async();
+  serde::ASTLoader{ctx, dir}.load();
+  EXPECT_THROW(failed.get(), std::system_error);
+  EXPECT_FALSE(literals.all_dirty());
+  EXPECT_TRUE(ctx.snapshot_state());
+  set(3, 30);
+  serde::ASTSaver{ctx, dir}.save_delta();
+  EXPECT_TRUE(std::filesystem::exists(first_delta));
+}
+
+TEST(Serialization, FixedSize) {
+  using serde::detail::kSerializedSize;
+  static_assert(kSerializedSize<ast::IntegerLiteralExpr> == 8);
+  static_assert(kSerializedSize<ast::IntegralType> == 4);
+  static_assert(kSerializedSize<ast::BinaryExpr> == serde::detail::kVariableSize);
+
+  auto dir = std::filesystem::path{testing::TempDir()} / "fixed_size";
+  std::filesystem::create_directories(dir);
+  {
+    ast::ASTContext ctx;
+    // A free slot before the literals of the bodies.
+    auto *unused = ctx.create<ast::IntegerLiteralExpr>(100);
+    build_funcs(ctx, 3);
+    ctx.destroy(unused);
+    ctx.pool<ast::BinaryExpr>().for_each([](std::size_t, const ast::BinaryExpr &add) {
+      EXPECT_EQ(serde::detail::serialized_size(add), 4 + 8 + 8);
+    });
+    serde::ASTSaver{ctx, dir}.save();
+  }
+
+  serde::SnapshotReader reader{serde::snapshot_path(dir), serde::LoadMode::kStream};
+  const int literal_id = ast::IntegerLiteralExpr::kClassID;
+  EXPECT_FALSE(reader.find(serde::node_index_section(literal_id)));
+  EXPECT_TRUE(reader.find(serde::node_index_section(ast::BinaryExpr::kClassID)));
+  // Slot and free slot counts, the free slot, then the nodes.
+  EXPECT_EQ(reader.find(literal_id)->raw_length, 8 + 8 + 4 + 3 * 8);
+
+  // Lazy loading finds the literals by arithmetic.
+  ast::ASTContext ctx;
+  serde::ASTLoader{ctx, dir, serde::LoadMode::kLazy}.load();
+  auto &funcs = ctx.pool<ast::FuncDecl>();
+  auto *add = static_cast<ast::BinaryExpr *>(funcs.at(2).get_body()->last_expr);
+  EXPECT_EQ(static_cast<ast::IntegerLiteralExpr *>(add->rhs)->value, 2);
+  EXPECT_EQ(ctx.pool<ast::IntegerLiteralExpr>().num_nodes(), 1);
+}
+
+TEST(Serialization, PlainPools) {
+  auto dir = std::filesystem::path{testing::TempDir()} / "plain_pools";
+  std::filesystem::create_directories(dir);
+  constexpr std::uint64_t kNumLiterals = 1000;
+  for (auto format : {serde::io::Format::kFixed, serde::io::Format::kCompact}) {
+    {
+      ast::ASTContext ctx;
+      std::vector<ast::IntegerLiteralExpr *> literals;
+      for (std::uint64_t i = 0; i < kNumLiterals; i++)
+        literals.push_back(ctx.create<ast::IntegerLiteralExpr>(i * i + 500));
+      // Free slots between the nodes copied in one go.
+      for (std::uint64_t i = 0; i < kNumLiterals; i += 7)
+        ctx.destroy(literals[i]);
+      ctx.create<ast::IntegralType>(true, 32);
+      ctx.create<ast::IntegralType>(false, 8);
+      serde::ASTSaver{ctx, dir, format}.save();
+    }
+
+    if (format == serde::io::Format::kFixed) {
+      // Counts and free slots, then the values back to back.
+      serde::SnapshotReader reader{serde::snapshot_path(dir), serde::LoadMode::kStream};
+      const auto section = *reader.find(ast::IntegerLiteralExpr::kClassID);
+      const std::uint64_t num_dead = (kNumLiterals + 6) / 7;
+      EXPECT_EQ(section.raw_length, 8 + 8 + 4 * num_dead + 8 * (kNumLiterals - num_dead));
+      reader.read_section(section, [](serde::io::BufferedReader &in) {
+        in.read_value<std::size_t>();
+        for (std::size_t n = in.read_value<std::size_t>(); n; n--)
+          in.read_value<std::uint32_t>();
+        EXPECT_EQ(in.read_value<std::uint64_t>(), 1 * 1 + 500);
+        EXPECT_EQ(in.read_value<std::uint64_t>(), 2 * 2 + 500);
+      });
+    }
+
+    for (auto mode : {serde::LoadMode::kStream, serde::LoadMode::kMapped}) {
+      ast::ASTContext ctx;
+      serde::ASTLoader{ctx, dir, mode}.load();
+      auto &literals = ctx.pool<ast::IntegerLiteralExpr>();
+      ASSERT_EQ(literals.num_slots(), kNumLiterals);
+      for (std::uint64_t i = 0; i < kNumLiterals; i++) {
+        ASSERT_EQ(literals.is_live(i), i % 7 != 0);
+        if (i % 7)
+          EXPECT_EQ(literals.at(i).value, i * i + 500);
+      }
+      auto &types = ctx.pool<ast::IntegralType>();
+      ASSERT_EQ(types.num_nodes(), 2);
+      EXPECT_TRUE(types.at(0).is_signed());
+      EXPECT_EQ(types.at(0).width(), 32);
+      EXPECT_FALSE(types.at(1).is_signed());
+      EXPECT_EQ(types.at(1).width(), 8);
+    }
+  }
+}